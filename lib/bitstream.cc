@@ -0,0 +1,118 @@
+#include "globals.h"
+#include "bitstream.h"
+
+constexpr size_t Bitstream::npos;
+
+void Bitstream::resize(size_t size)
+{
+    _words.resize((size + 63) / 64);
+    _size = size;
+    while (!_weakPulses.empty() && (_weakPulses.back().position >= size))
+        _weakPulses.pop_back();
+
+    /* Keep the invariant that the unused tail of the last word is clear. */
+    unsigned tail = size % 64;
+    if (tail)
+        _words.back() &= ~0ULL << (64 - tail);
+}
+
+/*
+ * Rather than sliding a window along one bit at a time, this tests 64
+ * candidate positions at once: word(base+j) holds bit j of every candidate,
+ * so ANDing together either it or its inverse for each bit of the pattern
+ * leaves set only those candidates which match so far. Only the first 16
+ * bits are used as a filter, and the set bits are tested first as on real
+ * encoded data they're the rarer ones; the few survivors are then checked in
+ * full.
+ */
+size_t Bitstream::find(uint64_t pattern, unsigned width, size_t from, size_t to) const
+{
+    assert((width > 0) && (width <= 64));
+    unsigned filterwidth = std::min(width, 16U);
+    uint64_t filter = pattern >> (width - filterwidth);
+
+    unsigned ones[16];
+    unsigned zeroes[16];
+    unsigned numOnes = 0;
+    unsigned numZeroes = 0;
+    for (unsigned j = 0; j < filterwidth; j++)
+    {
+        if ((filter >> (filterwidth - 1 - j)) & 1)
+            ones[numOnes++] = j;
+        else
+            zeroes[numZeroes++] = j;
+    }
+
+    to = std::min(to, _size - std::min<size_t>(_size, width - 1));
+    if (from >= to)
+        return npos;
+
+    /* Work in whole words; candidates before from are masked off. */
+    uint64_t startmask = ~0ULL >> (from % 64);
+    for (size_t w = from / 64; (w * 64) < to; w++)
+    {
+        /* Bits w*64 to w*64+127; each candidate window is a shift of these. */
+        uint64_t hi = _words[w];
+        uint64_t lo = ((w+1) < _words.size()) ? _words[w+1] : 0;
+        auto window = [&](unsigned j)
+        {
+            return j ? ((hi << j) | (lo >> (64 - j))) : hi;
+        };
+
+        uint64_t candidates = startmask;
+        startmask = ~0ULL;
+        for (unsigned i = 0; i < numOnes; i++)
+            candidates &= window(ones[i]);
+        for (unsigned i = 0; (i < numZeroes) && candidates; i++)
+            candidates &= ~window(zeroes[i]);
+
+        while (candidates)
+        {
+            unsigned k = __builtin_clzll(candidates);
+            candidates &= ~(1ULL << (63 - k));
+
+            size_t pos = w*64 + k;
+            if (pos >= to)
+                return npos;
+            if (get(pos, width) == pattern)
+                return pos;
+        }
+    }
+
+    return npos;
+}
+
+void Bitstream::put(size_t index, uint64_t data, unsigned count)
+{
+    if (index >= _size)
+        return;
+    if (count > (_size - index))
+    {
+        unsigned dropped = count - (_size - index);
+        data >>= dropped;
+        count -= dropped;
+    }
+    if (count == 0)
+        return;
+    if (count < 64)
+        data &= (1ULL << count) - 1;
+
+    size_t w = index / 64;
+    unsigned shift = index % 64;
+    unsigned end = shift + count;
+    if (end <= 64)
+    {
+        uint64_t mask = ((count == 64) ? ~0ULL : ((1ULL << count) - 1)) << (64 - end);
+        _words[w] = (_words[w] & ~mask) | (data << (64 - end));
+    }
+    else
+    {
+        /* Straddles a word boundary; shift is non-zero here. */
+        unsigned spill = end - 64;
+        uint64_t mask = (1ULL << (64 - shift)) - 1;
+        _words[w] = (_words[w] & ~mask) | (data >> spill);
+
+        uint64_t spillmask = ~0ULL << (64 - spill);
+        _words[w+1] = (_words[w+1] & ~spillmask) | (data << (64 - spill));
+    }
+}
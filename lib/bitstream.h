@@ -0,0 +1,104 @@
+#ifndef BITSTREAM_H
+#define BITSTREAM_H
+
+/*
+ * A pulse which landed well away from the clock grid when bits were decoded,
+ * and so might really belong in the neighbouring cell; offset is how late
+ * the pulse was, in 256ths of a cell.
+ */
+struct WeakPulse
+{
+    size_t position;
+    int offset;
+};
+
+/*
+ * A packed array of bits, stored most significant bit first in 64-bit words:
+ * bit 0 of the stream is the top bit of word 0. This is the same order in
+ * which the decoders shift bits into their FIFOs, so any run of up to 64
+ * bits can be pulled out at any offset with a couple of shifts.
+ *
+ * Bits past the end of the stream are always zero.
+ */
+class Bitstream
+{
+public:
+    static constexpr size_t npos = ~(size_t)0;
+
+    Bitstream() {}
+    Bitstream(size_t size) { resize(size); }
+
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+    void resize(size_t size);
+    void clear() { resize(0); }
+
+    bool operator [] (size_t index) const
+    {
+        return (_words[index / 64] >> (63 - (index % 64))) & 1;
+    }
+
+    void set(size_t index, bool bit)
+    {
+        uint64_t mask = 1ULL << (63 - (index % 64));
+        uint64_t& w = _words[index / 64];
+        w = bit ? (w | mask) : (w & ~mask);
+    }
+
+    void push_back(bool bit)
+    {
+        resize(_size + 1);
+        set(_size - 1, bit);
+    }
+
+    /* Returns the 64 bits starting at index, with bit `index` at the top. */
+    uint64_t word(size_t index) const
+    {
+        size_t w = index / 64;
+        unsigned shift = index % 64;
+        uint64_t hi = (w < _words.size()) ? _words[w] : 0;
+        if (shift == 0)
+            return hi;
+        uint64_t lo = ((w+1) < _words.size()) ? _words[w+1] : 0;
+        return (hi << shift) | (lo >> (64 - shift));
+    }
+
+    /* Returns count (0 to 64) bits starting at index, right-aligned. */
+    uint64_t get(size_t index, unsigned count) const
+    {
+        if (count == 0)
+            return 0;
+        return word(index) >> (64 - count);
+    }
+
+    /*
+     * Writes the bottom count bits of data starting at index, most significant
+     * first. Anything which would land past the end of the stream is dropped.
+     */
+    void put(size_t index, uint64_t data, unsigned count);
+
+    /*
+     * Returns the position of the first occurrence of the width-bit (1 to 64)
+     * pattern starting at or after from (and before to), or npos.
+     */
+    size_t find(uint64_t pattern, unsigned width,
+        size_t from = 0, size_t to = npos) const;
+
+    const std::vector<uint64_t>& words() const { return _words; }
+
+    /* Weak pulses are kept in order of position. */
+    void addWeakPulse(size_t position, int offset)
+    {
+        _weakPulses.push_back({ position, offset });
+    }
+
+    const std::vector<WeakPulse>& weakPulses() const { return _weakPulses; }
+
+private:
+    size_t _size = 0;
+    std::vector<uint64_t> _words;
+    std::vector<WeakPulse> _weakPulses;
+};
+
+#endif
@@ -9,12 +9,13 @@
 
 class Sector;
 class Fluxmap;
+class Bitstream;
 
 
 class BrotherBitmapDecoder : public BitmapDecoder
 {
 public:
-	RecordVector decodeBitsToRecords(const std::vector<bool>& bitmap) const;
+	RecordVector decodeBitsToRecords(const Bitstream& bitmap) const;
 };
 
 class BrotherRecordParser : public RecordParser
@@ -22,11 +23,12 @@ class BrotherRecordParser : public RecordParser
 public:
 	std::vector<std::unique_ptr<Sector>> parseRecordsToSectors(
 		const RecordVector& records) const;
+	int checkRawSector(const ByteSpan& raw) const;
 };
 
-extern void writeBrotherSectorHeader(std::vector<bool>& bits, unsigned& cursor,
+extern void writeBrotherSectorHeader(Bitstream& bits, unsigned& cursor,
 		int track, int sector);
-extern void writeBrotherSectorData(std::vector<bool>& bits, unsigned& cursor,
+extern void writeBrotherSectorData(Bitstream& bits, unsigned& cursor,
 		const std::vector<uint8_t>& data);
 
 #endif
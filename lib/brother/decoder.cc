@@ -1,13 +1,12 @@
 #include "globals.h"
 #include "sql.h"
 #include "fluxmap.h"
+#include "bitstream.h"
 #include "decoders.h"
 #include "record.h"
 #include "brother.h"
 #include <ctype.h>
 
-static std::vector<uint8_t> outputbuffer;
-
 /*
  * Brother disks have this very very non-IBM system where sector header records
  * and data records use two different kinds of GCR: sector headers are 8-in-16
@@ -45,15 +44,16 @@ static int decode_header_gcr(uint16_t word)
 	return -1;             
 };
 
-static void add_record(RecordVector& records,
+static void add_record(RecordVector& records, const std::shared_ptr<RecordArena>& arena,
 	nanoseconds_t position, const std::vector<uint8_t>& data)
 {
-	records.push_back(std::unique_ptr<Record>(new Record(position, data)));
+	records.push_back(std::unique_ptr<Record>(new Record(position, arena->copy(data), arena)));
 }
 
-RecordVector BrotherBitmapDecoder::decodeBitsToRecords(const std::vector<bool>& bits) const
+RecordVector BrotherBitmapDecoder::decodeBitsToRecords(const Bitstream& bits) const
 {
     RecordVector records;
+    auto arena = RecordArena::create();
 
 	enum
 	{
@@ -65,6 +65,7 @@ RecordVector BrotherBitmapDecoder::decodeBitsToRecords(const std::vector<bool>&
     size_t cursor = 0;
     uint32_t inputfifo = 0;
 	int inputcount = 0;
+	std::vector<uint8_t> outputbuffer;
 	uint8_t outputfifo = 0;
 	int outputcount = 0;
     int state = SEEKING;
@@ -79,7 +80,7 @@ RecordVector BrotherBitmapDecoder::decodeBitsToRecords(const std::vector<bool>&
 		if (inputfifo == BROTHER_SECTOR_RECORD)
 		{
 			if (state != SEEKING)
-				add_record(records, recordstart, outputbuffer);
+				add_record(records, arena, recordstart, outputbuffer);
 			outputbuffer.resize(1);
 			outputbuffer[0] = BROTHER_SECTOR_RECORD & 0xff;
 			state = READINGSECTOR;
@@ -89,7 +90,7 @@ RecordVector BrotherBitmapDecoder::decodeBitsToRecords(const std::vector<bool>&
 		else if (inputfifo == BROTHER_DATA_RECORD)
 		{
 			if (state != SEEKING)
-				add_record(records, recordstart, outputbuffer);
+				add_record(records, arena, recordstart, outputbuffer);
 			outputbuffer.resize(1);
 			outputbuffer[0] = BROTHER_DATA_RECORD & 0xff;
 			state = READINGDATA;
@@ -137,7 +138,7 @@ RecordVector BrotherBitmapDecoder::decodeBitsToRecords(const std::vector<bool>&
     }
 
 	if (state != SEEKING)
-		add_record(records, recordstart, outputbuffer);
+		add_record(records, arena, recordstart, outputbuffer);
 
     return records;
 }
@@ -1,4 +1,5 @@
 #include "globals.h"
+#include "bitstream.h"
 #include "record.h"
 #include "decoders.h"
 #include "brother.h"
@@ -28,19 +29,13 @@ static int encode_data_gcr(uint8_t data)
 	return -1;             
 };
 
-static void write_bits(std::vector<bool>& bits, unsigned& cursor, uint32_t data, int width)
+static void write_bits(Bitstream& bits, unsigned& cursor, uint32_t data, int width)
 {
+	bits.put(cursor, data, width);
 	cursor += width;
-	for (int i=0; i<width; i++)
-	{
-		unsigned pos = cursor - i - 1;
-		if (pos < bits.size())
-			bits[pos] = data & 1;
-		data >>= 1;
-	}
 }
 
-void writeBrotherSectorHeader(std::vector<bool>& bits, unsigned& cursor,
+void writeBrotherSectorHeader(Bitstream& bits, unsigned& cursor,
 		int track, int sector)
 {
 	write_bits(bits, cursor, 0xffffffff, 31);
@@ -50,7 +45,7 @@ void writeBrotherSectorHeader(std::vector<bool>& bits, unsigned& cursor,
 	write_bits(bits, cursor, encode_header_gcr(0x2f), 16);
 }
 
-void writeBrotherSectorData(std::vector<bool>& bits, unsigned& cursor,
+void writeBrotherSectorData(Bitstream& bits, unsigned& cursor,
 		const std::vector<uint8_t>& data)
 {
 	write_bits(bits, cursor, 0xffffffff, 32);
@@ -14,10 +14,11 @@ std::vector<std::unique_ptr<Sector>> BrotherRecordParser::parseRecordsToSectors(
 	int nextSector = 0;
     bool hasHeader = false;
     std::vector<std::unique_ptr<Sector>> sectors;
+    auto arena = RecordArena::create();
 
     for (auto& record : records)
     {
-		const std::vector<uint8_t>& data = record->data;
+		const ByteSpan& data = record->data;
         switch (data[0])
         {
             case BROTHER_SECTOR_RECORD & 0xff:
@@ -30,18 +31,18 @@ std::vector<std::unique_ptr<Sector>> BrotherRecordParser::parseRecordsToSectors(
 
             case BROTHER_DATA_RECORD & 0xff:
             {
-                if (data.size() < (BROTHER_DATA_RECORD_PAYLOAD+1))
+                if (data.size() < (BROTHER_DATA_RECORD_PAYLOAD+4))
                     goto garbage;
 				if (!hasHeader)
 					goto garbage;
-				uint32_t realCrc = crcbrother(&data[1], &data[257]);
-				uint32_t wantCrc = (data[257]<<16) | (data[258]<<8) | data[259];
-				int status = (realCrc == wantCrc) ? Sector::OK : Sector::BAD_CHECKSUM;
+                size_t size = BROTHER_DATA_RECORD_PAYLOAD+4;
+                uint8_t* raw = arena->allocate(size);
+                memcpy(raw, data.data(), size);
+				int status = checkRawSector(ByteSpan(raw, size));
 
-                std::vector<uint8_t> sectordata(BROTHER_DATA_RECORD_PAYLOAD);
-                memcpy(&sectordata[0], &data[1], BROTHER_DATA_RECORD_PAYLOAD);
-
-                auto sector = std::unique_ptr<Sector>(new Sector(status, nextTrack, 0, nextSector, sectordata));
+                auto sector = std::unique_ptr<Sector>(
+                    new Sector(status, nextTrack, 0, nextSector, ByteSpan(raw, size),
+                        arena, 1, BROTHER_DATA_RECORD_PAYLOAD));
                 sectors.push_back(std::move(sector));
                 hasHeader = false;
                 break;
@@ -55,3 +56,14 @@ std::vector<std::unique_ptr<Sector>> BrotherRecordParser::parseRecordsToSectors(
 
     return sectors;
 }
+
+/* The record type byte, the payload, and a three byte checksum of the payload. */
+int BrotherRecordParser::checkRawSector(const ByteSpan& raw) const
+{
+    if (raw.size() != (BROTHER_DATA_RECORD_PAYLOAD+4))
+        return Sector::BAD_CHECKSUM;
+
+    uint32_t realCrc = crcbrother(&raw[1], &raw[257]);
+    uint32_t wantCrc = (raw[257]<<16) | (raw[258]<<8) | raw[259];
+    return (realCrc == wantCrc) ? Sector::OK : Sector::BAD_CHECKSUM;
+}
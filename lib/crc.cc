@@ -1,10 +1,141 @@
 #include "globals.h"
 #include "crc.h"
+#include <string.h>
 
-uint16_t crc16(uint16_t poly, const uint8_t* start, const uint8_t* end)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_CLMUL
+#endif
+
+/*
+ * Both CRCs here work most significant bit first, over polynomials of
+ * degree WIDTH, which includes a leading term the poly constants leave
+ * out. crc16() is the usual sort, where the result is the message times
+ * x^16 mod the polynomial (with the initial value of 0xffff xored into the
+ * first two bytes); crcbrother() leaves out the x^16, and so is just the
+ * message mod the polynomial.
+ *
+ * They're computed with slice-by-8 tables, eight bytes at a time; or, for
+ * long buffers on machines which have carry-less multiplication, by folding
+ * the buffer sixteen bytes at a time and only running the tables over the
+ * last few bytes.
+ */
+
+#define BROTHER_WIDTH 24
+
+/* Returns a times x^n mod the polynomial; a must be less than 1<<width. */
+static uint32_t shift_mod(uint32_t a, uint64_t n, uint32_t poly, int width)
 {
-	uint16_t crc = 0xffff;
+	uint32_t top = 1U << (width-1);
+	uint32_t mask = (top << 1) - 1;
+	while (n--)
+		a = ((a & top) ? ((a << 1) ^ poly) : (a << 1)) & mask;
+	return a;
+}
+
+/* Returns a times b mod the polynomial. */
+static uint32_t mul_mod(uint32_t a, uint32_t b, uint32_t poly, int width)
+{
+	uint32_t result = 0;
+	for (int i=width-1; i>=0; i--)
+	{
+		result = shift_mod(result, 1, poly, width);
+		if (b & (1U << i))
+			result ^= a;
+	}
+	return result;
+}
+
+/* Returns x^n mod the polynomial, by repeated squaring. */
+static uint32_t pow_mod(uint64_t n, uint32_t poly, int width)
+{
+	uint32_t result = 1;
+	uint32_t square = 2;
+	for (; n; n >>= 1)
+	{
+		if (n & 1)
+			result = mul_mod(result, square, poly, width);
+		square = mul_mod(square, square, poly, width);
+	}
+	return result;
+}
+
+/* Entry [k][v] is v times x^(width + 8k) mod the polynomial. */
+template <typename T>
+struct CrcTables
+{
+	CrcTables(uint32_t poly, int width)
+	{
+		for (int v=0; v<256; v++)
+		{
+			uint32_t r = shift_mod(v, width, poly, width);
+			for (int k=0; k<8; k++)
+			{
+				table[k][v] = r;
+				r = shift_mod(r, 8, poly, width);
+			}
+		}
+	}
+
+	T table[8][256];
+};
+
+#if defined(HAVE_CLMUL)
+/* The folding multipliers: x^192 and x^128 mod the polynomial. */
+struct ClmulConstants
+{
+	ClmulConstants(uint32_t poly, int width):
+		k192(pow_mod(192, poly, width)),
+		k128(pow_mod(128, poly, width))
+	{}
+
+	uint64_t k192;
+	uint64_t k128;
+};
+
+static bool have_clmul()
+{
+	static const bool supported = __builtin_cpu_supports("pclmul")
+		&& __builtin_cpu_supports("ssse3");
+	return supported;
+}
+
+/*
+ * Folds all the whole sixteen-byte blocks of the buffer into one, which is
+ * congruent to them mod the polynomial; init is xored into the top of the
+ * first. Blocks are byte swapped on loading so that the most significant
+ * bit of the register is the first bit of the message, and the products
+ * line up without any reflection. Returns the number of bytes consumed.
+ */
+__attribute__((target("pclmul,ssse3")))
+static size_t clmul_fold(const uint8_t* ptr, size_t len, uint32_t init, int width,
+	const ClmulConstants& constants, uint8_t* folded)
+{
+	const __m128i swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	const __m128i k = _mm_set_epi64x(constants.k192, constants.k128);
+
+	size_t blocks = len / 16;
+	__m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)ptr), swap);
+	a = _mm_xor_si128(a, _mm_set_epi64x((uint64_t)init << (64 - width), 0));
+	for (size_t i=1; i<blocks; i++)
+	{
+		__m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(ptr + i*16)), swap);
+		__m128i hi = _mm_clmulepi64_si128(a, k, 0x11);
+		__m128i lo = _mm_clmulepi64_si128(a, k, 0x00);
+		a = _mm_xor_si128(_mm_xor_si128(hi, lo), b);
+	}
+
+	_mm_storeu_si128((__m128i*)folded, _mm_shuffle_epi8(a, swap));
+	return blocks * 16;
+}
+
+/* Below this, setting up the fold costs more than it saves. */
+#define CLMUL_THRESHOLD 64
+#endif
 
+static uint16_t crc16_bitwise(uint16_t poly, uint16_t crc,
+	const uint8_t* start, const uint8_t* end)
+{
 	while (start != end)
 	{
 		crc ^= *start++ << 8;
@@ -15,19 +146,93 @@ uint16_t crc16(uint16_t poly, const uint8_t* start, const uint8_t* end)
 	return crc;
 }
 
+static uint16_t crc16_sliced(uint16_t crc, const uint8_t* start, const uint8_t* end)
+{
+	static const CrcTables<uint16_t> tables(CCITT_POLY, 16);
+	const auto& t = tables.table;
+	while ((end - start) >= 8)
+	{
+		const uint8_t* p = start;
+		unsigned x = crc ^ ((p[0] << 8) | p[1]);
+		crc = t[7][x >> 8] ^ t[6][x & 0xff] ^ t[5][p[2]] ^ t[4][p[3]]
+			^ t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+		start += 8;
+	}
+
+	while (start != end)
+		crc = (crc << 8) ^ t[0][(crc >> 8) ^ *start++];
+	return crc;
+}
+
+uint16_t crc16(uint16_t poly, const uint8_t* start, const uint8_t* end)
+{
+	uint16_t crc = 0xffff;
+	if (poly != CCITT_POLY)
+		return crc16_bitwise(poly, crc, start, end);
+
+#if defined(HAVE_CLMUL)
+	if (((end - start) >= CLMUL_THRESHOLD) && have_clmul())
+	{
+		static const ClmulConstants constants(CCITT_POLY, 16);
+		uint8_t folded[16];
+		start += clmul_fold(start, end - start, crc, 16, constants, folded);
+		crc = crc16_sliced(0, folded, folded + 16);
+	}
+#endif
+
+	return crc16_sliced(crc, start, end);
+}
+
+static uint32_t crcbrother_sliced(uint32_t crc, const uint8_t* start, const uint8_t* end)
+{
+	static const CrcTables<uint32_t> tables(BROTHER_POLY, BROTHER_WIDTH);
+	const auto& t = tables.table;
+	while ((end - start) >= 8)
+	{
+		const uint8_t* p = start;
+		crc = t[7][crc >> 16] ^ t[6][(crc >> 8) & 0xff] ^ t[5][crc & 0xff]
+			^ t[4][p[0]] ^ t[3][p[1]] ^ t[2][p[2]] ^ t[1][p[3]] ^ t[0][p[4]]
+			^ (p[5] << 16) ^ (p[6] << 8) ^ p[7];
+		start += 8;
+	}
+
+	while (start != end)
+		crc = ((crc << 8) & 0xffffff) ^ t[0][crc >> 16] ^ *start++;
+	return crc;
+}
+
 /* Thanks to user202729 on StackOverflow for miraculously reverse engineering
  * this. */
 uint32_t crcbrother(const uint8_t* start, const uint8_t* end)
 {
-	uint32_t crc = *start++;
+	uint32_t crc = 0;
 
-	while (start != end)
+#if defined(HAVE_CLMUL)
+	if (((end - start) >= CLMUL_THRESHOLD) && have_clmul())
 	{
-		for (int i=0; i<8; i++)
-			crc = (crc & 0x800000) ? ((crc<<1)^BROTHER_POLY) : (crc<<1);
-		crc ^= *start++;
+		static const ClmulConstants constants(BROTHER_POLY, BROTHER_WIDTH);
+		uint8_t folded[16];
+		start += clmul_fold(start, end - start, crc, BROTHER_WIDTH, constants, folded);
+		crc = crcbrother_sliced(0, folded, folded + 16);
 	}
+#endif
+
+	return crcbrother_sliced(crc, start, end);
+}
 
-	return crc & 0xFFFFFF;
+/*
+ * Flipping a bit flips its term of the message polynomial, which changes
+ * the CRC by that term mod the polynomial.
+ */
+
+uint16_t crc16FlipBit(uint16_t poly, uint16_t crc, size_t len, size_t bit)
+{
+	assert(bit < (len*8));
+	return crc ^ pow_mod((len*8 - 1 - bit) + 16, poly, 16);
 }
 
+uint32_t crcbrotherFlipBit(uint32_t crc, size_t len, size_t bit)
+{
+	assert(bit < (len*8));
+	return crc ^ pow_mod(len*8 - 1 - bit, BROTHER_POLY, BROTHER_WIDTH);
+}
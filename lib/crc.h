@@ -7,5 +7,13 @@
 extern uint16_t crc16(uint16_t poly, const uint8_t* start, const uint8_t* end);
 extern uint32_t crcbrother(const uint8_t* start, const uint8_t* end);
 
+/*
+ * Given the CRC of a buffer of len bytes, returns the CRC it would have with
+ * one bit flipped, counting from the top bit of the first byte; this is far
+ * cheaper than recomputing it. Flip several bits by calling it repeatedly.
+ */
+extern uint16_t crc16FlipBit(uint16_t poly, uint16_t crc, size_t len, size_t bit);
+extern uint32_t crcbrotherFlipBit(uint32_t crc, size_t len, size_t bit);
+
 #endif
 
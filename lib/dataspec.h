@@ -63,6 +63,7 @@ public:
 
     bool hasArgument() const { return true; }
     const std::string defaultValueAsString() const { return value; }
+    const std::string valueAsString() const { return value; }
     void set(const std::string& value) { this->value.set(value); }
 
 public:
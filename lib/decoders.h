@@ -31,34 +31,109 @@ struct IbmIdam
     uint8_t crc[2];
 };
 
+/*
+ * Pulses at least this far from the clock grid, in 256ths of a cell, are
+ * noted as weak when decoding bits.
+ */
+#define WEAK_PULSE_OFFSET 32
+
 class Sector;
 class Fluxmap;
+class Bitstream;
 class Record;
+struct WeakPulse;
 typedef std::vector<std::unique_ptr<Record>> RecordVector;
 
+extern void addInterleavedWeakBits(Record& record,
+    const std::vector<WeakPulse>& weakPulses, size_t start);
+
+/*
+ * Walks through a fluxmap a pulse at a time, placing each pulse in a bit
+ * cell exactly as Fluxmap::decodeToBits() does with a fixed clock, but
+ * without building a bitstream.
+ *
+ * The clock isn't quite fixed: if parts of the track turn out to have been
+ * written faster or slower than the rest, the clock is adjusted to suit
+ * while in those parts.
+ */
+class FluxPulses
+{
+public:
+    FluxPulses(const Fluxmap& fluxmap, nanoseconds_t clockPeriod);
+
+    /* Moves to the next pulse; returns false when there are no more. */
+    bool next();
+
+    /* The length of the bitstream decodeToBits() would produce. */
+    size_t size() const { return _size; }
+
+    /* How many intervals have been read, up to and including the current pulse's. */
+    size_t intervals() const { return _ptr - _start; }
+
+    size_t position = 0;   /* the current pulse's bit cell */
+    unsigned cells = 0;    /* the number of cells since the last pulse */
+    int offset = 0;        /* how late the pulse was, in 256ths of a cell */
+
+private:
+    /* A stretch of the track, from start to the next zone, and its clock. */
+    struct ClockZone
+    {
+        const uint16_t* start;
+        nanoseconds_t clockPeriod;
+    };
+
+    void findClockZones(const Fluxmap& fluxmap);
+
+    const uint16_t* _start;
+    const uint16_t* _ptr;
+    const uint16_t* _end;
+    nanoseconds_t _clockPeriod;
+    nanoseconds_t _lowerThreshold;
+    size_t _size;
+    std::vector<ClockZone> _zones;
+    size_t _zone = 0;
+};
+
+/*
+ * Decoders and parsers keep no state between calls, so a single instance may
+ * be used from several threads at once.
+ */
 class BitmapDecoder
 {
 public:
     virtual ~BitmapDecoder() {}
 
-    virtual nanoseconds_t guessClock(Fluxmap& fluxmap) const;
+    virtual nanoseconds_t guessClock(const Fluxmap& fluxmap) const;
 
     virtual RecordVector decodeBitsToRecords(
-        const std::vector<bool>& bitmap) const = 0;
+        const Bitstream& bitmap) const = 0;
+
+    /*
+     * Decodes flux straight to records. By default this decodes the whole
+     * track to bits first; decoders which can find their marks in the flux
+     * itself needn't.
+     */
+    virtual RecordVector decodeFluxToRecords(
+        const Fluxmap& fluxmap, nanoseconds_t clockPeriod) const;
+
+    /* Whether bits are being decoded with the PLL, which FluxPulses can't do. */
+    static bool usingPll();
 };
 
 class FmBitmapDecoder : public BitmapDecoder
 {
 public:
-    nanoseconds_t guessClock(Fluxmap& fluxmap) const;
-    RecordVector decodeBitsToRecords(const std::vector<bool>& bitmap) const;
+    nanoseconds_t guessClock(const Fluxmap& fluxmap) const;
+    RecordVector decodeBitsToRecords(const Bitstream& bitmap) const;
+    RecordVector decodeFluxToRecords(const Fluxmap& fluxmap, nanoseconds_t clockPeriod) const;
 };
 
 class MfmBitmapDecoder : public BitmapDecoder
 {
 public:
-    nanoseconds_t guessClock(Fluxmap& fluxmap) const;
-    RecordVector decodeBitsToRecords(const std::vector<bool>& bitmap) const;
+    nanoseconds_t guessClock(const Fluxmap& fluxmap) const;
+    RecordVector decodeBitsToRecords(const Bitstream& bitmap) const;
+    RecordVector decodeFluxToRecords(const Fluxmap& fluxmap, nanoseconds_t clockPeriod) const;
 };
 
 class RecordParser
@@ -68,6 +143,9 @@ public:
 
     virtual std::vector<std::unique_ptr<Sector>> parseRecordsToSectors(
         const RecordVector& records) const = 0;
+
+    /* Checks a sector's raw bytes against their checksum, returning a Sector::Status. */
+    virtual int checkRawSector(const ByteSpan& raw) const;
 };
 
 class IbmRecordParser : public RecordParser
@@ -80,10 +158,44 @@ public:
 
     std::vector<std::unique_ptr<Sector>> parseRecordsToSectors(
         const RecordVector& records) const;
+    int checkRawSector(const ByteSpan& raw) const;
 
 private:
     int _scheme;
     int _sectorIdBase;
 };
 
+/* A cluster of similar intervals in a fluxmap's interval histogram. */
+struct FluxPeak
+{
+    double ticks;      /* the middle of the peak, to a fraction of a tick */
+    unsigned count;    /* how many intervals it contains */
+};
+
+extern std::vector<FluxPeak> findFluxPeaks(const Fluxmap& fluxmap);
+
+/* Encodings which can be told apart from the flux alone. */
+
+enum
+{
+    ENCODING_FM,
+    ENCODING_MFM,
+    ENCODING_BROTHER
+};
+
+struct EncodingGuess
+{
+    int encoding;
+    nanoseconds_t clockPeriod; /* the length of one bit cell */
+    double score;              /* from 0 (hopeless) to 1 (certain) */
+};
+
+extern const std::string encodingToString(int encoding);
+
+/*
+ * Ranks the encodings the flux might be in, most likely first, by how well
+ * the peaks in its interval histogram fit each encoding's run lengths.
+ */
+extern std::vector<EncodingGuess> guessEncodings(const Fluxmap& fluxmap);
+
 #endif
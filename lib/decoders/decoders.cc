@@ -1,13 +1,19 @@
 #include "globals.h"
 #include "flags.h"
 #include "fluxmap.h"
+#include "bitstream.h"
 #include "decoders.h"
+#include "record.h"
+#include "sector.h"
 #include "protocol.h"
 #include "fmt/format.h"
+#include <algorithm>
+#include <array>
+#include <math.h>
 
 static IntFlag clockDetectionNoiseFloor(
     { "--clock-detection-noise-floor" },
-    "Noise floor used for clock detection in flux.",
+    "Noise floor used for clock detection in flux, for a track of 75000 intervals (it's scaled to the actual length).",
     200);
 
 static DoubleFlag clockDecodeThreshold(
@@ -19,40 +25,156 @@ static SettableFlag showClockHistogram(
     { "--show-clock-histogram" },
     "Dump the clock detection histogram.");
 
-/* 
- * Tries to guess the clock by finding the smallest common interval.
- * Returns nanoseconds.
+static SettableFlag usePll(
+    { "--use-pll" },
+    "Decode bits with a phase-locked loop which tracks clock drift, rather than a fixed clock.");
+
+static IntFlag clockZoneSize(
+    { "--clock-zone-size" },
+    "Re-estimate the clock every this many flux intervals, to follow changes in speed along the track (0 uses one clock for the whole track).",
+    4096);
+
+static DoubleFlag pllPhaseGain(
+    { "--pll-phase-gain" },
+    "How much of each pulse's phase error the PLL corrects immediately (0 to 1).",
+    0.65);
+
+static DoubleFlag pllFrequencyGain(
+    { "--pll-frequency-gain" },
+    "How much of each pulse's phase error the PLL feeds into the clock period (0 to 1).",
+    0.04);
+
+/* The noise floor flag is for a track this long; about a revolution of flux. */
+#define NOISE_FLOOR_INTERVALS 75000
+
+/* A zone's clock is only changed if it's at least this far off... */
+#define CLOCK_ZONE_TOLERANCE 0.005
+
+/* ...and no further than this, which is more likely a bad estimate. */
+#define CLOCK_ZONE_MAX_DRIFT 0.25
+
+/* Intervals this long or longer all go in the last sub-histogram bucket. */
+#define HISTOGRAM_OVERFLOW 256
+
+/*
+ * Counts the intervals into buckets by length. Successive intervals are
+ * counted in different sub-histograms, merged at the end, so that runs of
+ * the same length (which is most of them) don't each wait for the last
+ * increment. Continuations land in bucket zero and long intervals in an
+ * overflow bucket, and neither is ever part of a peak.
  */
-nanoseconds_t Fluxmap::guessClock() const
+static void build_histogram(const uint16_t* p, size_t len, uint32_t buckets[256])
 {
-    uint32_t buckets[256] = {};
-    for (uint8_t interval : _intervals)
-        buckets[interval]++;
-    
-    int peaklo = 1;
-    while (peaklo < 256)
+    uint32_t sub[4][HISTOGRAM_OVERFLOW+1] = {};
+    for (size_t i=0; i<len; i++)
+        sub[i & 3][std::min<unsigned>(p[i], HISTOGRAM_OVERFLOW)]++;
+
+    for (int j=0; j<256; j++)
+        buckets[j] = sub[0][j] + sub[1][j] + sub[2][j] + sub[3][j];
+}
+
+static uint32_t noise_floor(size_t intervals)
+{
+    return std::max<uint64_t>(1,
+        (uint64_t)clockDetectionNoiseFloor * intervals / NOISE_FLOOR_INTERVALS);
+}
+
+/*
+ * Works out where the middle of the peak around the tallest bucket really
+ * is, to a fraction of a tick, by fitting a Gaussian through that bucket
+ * and its neighbours (which is a parabola through their logs). Unlike the
+ * mean, that isn't pulled about by a long tail on one side.
+ */
+static double fit_peak(const uint32_t buckets[256], int max)
+{
+    if ((max == 0) || (max == 255))
+        return max;
+
+    double a = buckets[max-1];
+    double b = buckets[max];
+    double c = buckets[max+1];
+    if ((a > 0) && (c > 0))
     {
-        if (buckets[peaklo] > (uint32_t)(clockDetectionNoiseFloor*2))
-            break;
-        peaklo++;
+        a = log(a);
+        b = log(b);
+        c = log(c);
     }
 
-    uint32_t peakmaxindex = peaklo;
-    uint32_t peakmaxvalue = buckets[peakmaxindex];
-    uint32_t peakhi = peaklo;
-    while (peakhi < 256)
+    double curvature = a - 2*b + c;
+    if (curvature >= 0)
+        return max;
+    return max + 0.5*(a - c)/curvature;
+}
+
+/*
+ * A peak starts with a bucket above twice the noise floor and spreads out
+ * either side until the buckets drop below it.
+ */
+static std::vector<FluxPeak> find_peaks(const uint32_t buckets[256], uint32_t floor)
+{
+    std::vector<FluxPeak> peaks;
+    int previous = 0;
+    for (int i=1; i<256; i++)
     {
-        uint32_t v = buckets[peakhi];
-        if (buckets[peakhi] < (uint32_t)clockDetectionNoiseFloor)
-            break;
-        if (v > peakmaxvalue)
+        if (buckets[i] <= (floor*2))
+            continue;
+
+        int lo = i;
+        while (((lo-1) > previous) && (buckets[lo-1] >= floor))
+            lo--;
+        int hi = i;
+        while (((hi+1) < 256) && (buckets[hi+1] >= floor))
+            hi++;
+
+        uint64_t count = 0;
+        int max = lo;
+        for (int j=lo; j<=hi; j++)
         {
-            peakmaxindex = peakhi;
-            peakmaxvalue = v;
+            count += buckets[j];
+            if (buckets[j] > buckets[max])
+                max = j;
         }
-        peakhi++;
+        peaks.push_back({ fit_peak(buckets, max), (unsigned)count });
+
+        previous = hi;
+        i = hi;
     }
 
+    return peaks;
+}
+
+/*
+ * Estimates the length of a bit cell, in ticks, from a histogram: every
+ * interval should be a whole number of cells long, and roughly cellTicks
+ * says how many. This uses the mean of every bucket above the noise floor
+ * rather than the peaks' middles, as it's steadier over a short stretch of
+ * flux. Returns 0 if there's nothing to go on.
+ */
+static double estimate_cell(const uint32_t buckets[256], uint32_t floor, double cellTicks)
+{
+    double ticks = 0.0;
+    double cells = 0.0;
+    for (int i=1; i<256; i++)
+    {
+        long n = lround(i / cellTicks);
+        if ((n < 1) || (buckets[i] < floor))
+            continue;
+        ticks += (double)i * buckets[i];
+        cells += (double)n * buckets[i];
+    }
+
+    return cells ? (ticks / cells) : 0.0;
+}
+
+/* 
+ * Tries to guess the clock by finding the smallest common interval.
+ * Returns nanoseconds.
+ */
+nanoseconds_t Fluxmap::guessClock() const
+{
+    uint32_t buckets[256];
+    build_histogram(ptr(), size(), buckets);
+
     if (showClockHistogram)
     {
         std::cout << "Clock detection histogram:" << std::endl;
@@ -63,47 +185,195 @@ nanoseconds_t Fluxmap::guessClock() const
     }
 
     /* 
-     * Okay, peakmaxindex should now be a good candidate for the (or a) clock.
+     * The first peak should now be a good candidate for the (or a) clock.
      * How this maps onto the actual clock rate depends on the encoding.
+     * With no peak at all, there's no clock; but something has to be
+     * returned, so it's the longest interval the histogram has.
      */
+    auto peaks = find_peaks(buckets, noise_floor(size()));
+    if (peaks.empty())
+        return HISTOGRAM_OVERFLOW * NS_PER_TICK;
+    return peaks.front().ticks * NS_PER_TICK;
+}
 
-    return peakmaxindex * NS_PER_TICK;
+/* Finds every peak in the interval histogram, not just the first. */
+std::vector<FluxPeak> findFluxPeaks(const Fluxmap& fluxmap)
+{
+    uint32_t buckets[256];
+    build_histogram(fluxmap.ptr(), fluxmap.size(), buckets);
+    return find_peaks(buckets, noise_floor(fluxmap.size()));
 }
 
 /* Decodes a fluxmap into a nice aligned array of bits. */
-std::vector<bool> Fluxmap::decodeToBits(nanoseconds_t clockPeriod) const
+Bitstream Fluxmap::decodeToBits(nanoseconds_t clockPeriod) const
+{
+    if (usePll)
+        return decodeToBitsWithPll(clockPeriod, pllPhaseGain, pllFrequencyGain,
+            clockDecodeThreshold);
+
+    FluxPulses pulses(*this, clockPeriod);
+    Bitstream bitmap(pulses.size());
+    while (pulses.next())
+    {
+        bitmap.set(pulses.position, true);
+        if (abs(pulses.offset) >= WEAK_PULSE_OFFSET)
+            bitmap.addWeakPulse(pulses.position, pulses.offset);
+    }
+
+    return bitmap;
+}
+
+FluxPulses::FluxPulses(const Fluxmap& fluxmap, nanoseconds_t clockPeriod):
+    _start(fluxmap.ptr()),
+    _ptr(fluxmap.ptr()),
+    _end(fluxmap.ptr() + fluxmap.size()),
+    _clockPeriod(clockPeriod),
+    _lowerThreshold(clockPeriod * clockDecodeThreshold),
+    _size(fluxmap.ticks() * NS_PER_TICK / clockPeriod)
+{
+    findClockZones(fluxmap);
+}
+
+/*
+ * Splits the track into zones and measures the cell length in each from its
+ * own histogram. Each zone is compared against the whole track (measured
+ * the same way, so any bias in the measurement cancels out), and where it
+ * runs faster or slower, the clock is scaled to match while in that zone.
+ * If no zone needs a different clock, there are no zones.
+ */
+void FluxPulses::findClockZones(const Fluxmap& fluxmap)
+{
+    size_t zoneSize = std::max(0, (int)clockZoneSize);
+    size_t zones = zoneSize ? (fluxmap.size() / zoneSize) : 0;
+    if (zones < 2)
+        return;
+
+    std::vector<std::array<uint32_t, 256>> histograms(zones);
+    uint32_t total[256] = {};
+    for (size_t z=0; z<zones; z++)
+    {
+        size_t start = z * zoneSize;
+        size_t end = ((z+1) == zones) ? fluxmap.size() : (start + zoneSize);
+        build_histogram(fluxmap.ptr() + start, end - start, histograms[z].data());
+        for (int i=0; i<256; i++)
+            total[i] += histograms[z][i];
+    }
+
+    double trackCell = estimate_cell(total, noise_floor(fluxmap.size()),
+        _clockPeriod / NS_PER_TICK);
+    if (trackCell == 0.0)
+        return;
+
+    bool adjusted = false;
+    double size = 0.0;
+    for (size_t z=0; z<zones; z++)
+    {
+        size_t start = z * zoneSize;
+        size_t end = ((z+1) == zones) ? fluxmap.size() : (start + zoneSize);
+        double cell = estimate_cell(histograms[z].data(), noise_floor(end - start), trackCell);
+        double drift = fabs(cell/trackCell - 1.0);
+
+        nanoseconds_t clockPeriod = _clockPeriod;
+        if (cell && (drift >= CLOCK_ZONE_TOLERANCE) && (drift <= CLOCK_ZONE_MAX_DRIFT))
+        {
+            clockPeriod = _clockPeriod * cell / trackCell;
+            adjusted = true;
+        }
+
+        _zones.push_back({ fluxmap.ptr() + start, clockPeriod });
+        size += (fluxmap.ticksAt(end) - fluxmap.ticksAt(start)) * NS_PER_TICK / clockPeriod;
+    }
+
+    if (!adjusted)
+        _zones.clear();
+    else
+        _size = size;
+}
+
+bool FluxPulses::next()
 {
-    int pulses = duration() / clockPeriod;
-    nanoseconds_t lowerThreshold = clockPeriod * clockDecodeThreshold;
+    while ((_zone < _zones.size()) && (_ptr >= _zones[_zone].start))
+    {
+        _clockPeriod = _zones[_zone++].clockPeriod;
+        _lowerThreshold = _clockPeriod * clockDecodeThreshold;
+    }
 
-    std::vector<bool> bitmap(pulses);
-    unsigned count = 0;
-    int cursor = 0;
+    /* Pulses too close to the last one are merged into the next. */
     nanoseconds_t timestamp = 0;
     for (;;)
     {
-        while (timestamp < lowerThreshold)
+        if (_ptr == _end)
+            return false;
+        uint16_t interval = *_ptr++;
+        if (!interval)
         {
-            if (cursor >= bytes())
-                goto abort;
-            uint8_t interval = (*this)[cursor++];
-            timestamp += interval * NS_PER_TICK;
+            timestamp += 0xffff * NS_PER_TICK;
+            continue;
         }
 
-        int clocks = (timestamp + clockPeriod/2) / clockPeriod;
-        count += clocks;
-        if (count >= bitmap.size())
-            goto abort;
-        bitmap[count] = true;
-        timestamp = 0;
+        timestamp += interval * NS_PER_TICK;
+        if (timestamp >= _lowerThreshold)
+            break;
     }
-abort:
 
-    return bitmap;
+    int clocks = (timestamp + _clockPeriod/2) / _clockPeriod;
+    position += clocks;
+    cells = clocks;
+    offset = (timestamp - clocks*_clockPeriod) * 256 / _clockPeriod;
+    return position < _size;
 }
 
-nanoseconds_t BitmapDecoder::guessClock(Fluxmap& fluxmap) const
+nanoseconds_t BitmapDecoder::guessClock(const Fluxmap& fluxmap) const
 {
     return fluxmap.guessClock();
 }
 
+bool BitmapDecoder::usingPll()
+{
+    return usePll;
+}
+
+RecordVector BitmapDecoder::decodeFluxToRecords(
+    const Fluxmap& fluxmap, nanoseconds_t clockPeriod) const
+{
+    return decodeBitsToRecords(fluxmap.decodeToBits(clockPeriod));
+}
+
+/*
+ * In FM and MFM, data bits alternate with clock bits, and data bit n of a
+ * record is raw bit start+2n+1. A weak pulse which really belongs in the
+ * neighbouring cell moves a one into or out of a data cell, so makes
+ * whichever of the two is a data cell suspect.
+ */
+void addInterleavedWeakBits(Record& record,
+    const std::vector<WeakPulse>& pulses, size_t start)
+{
+    size_t end = start + record.data.size()*16;
+    auto i = std::lower_bound(pulses.begin(), pulses.end(), start,
+        [](const WeakPulse& pulse, size_t position)
+        {
+            return pulse.position < position;
+        });
+
+    for (; (i != pulses.end()) && (i->position < end); i++)
+    {
+        size_t cell = i->position;
+        if (((cell - start) % 2) == 0)
+        {
+            if ((i->offset < 0) && (cell == start))
+                continue;
+            cell += (i->offset > 0) ? 1 : -1;
+        }
+
+        unsigned bit = (cell - start) / 2;
+        if (bit < (record.data.size()*8))
+            record.weakBits.push_back({ bit, (unsigned)abs(i->offset) });
+    }
+}
+
+/* Parsers which don't supply raw sector data can't check it. */
+int RecordParser::checkRawSector(const ByteSpan& raw) const
+{
+    return Sector::BAD_CHECKSUM;
+}
+
@@ -0,0 +1,129 @@
+#include "globals.h"
+#include "fluxmap.h"
+#include "decoders.h"
+#include "protocol.h"
+#include <algorithm>
+#include <math.h>
+
+/*
+ * Each encoding only ever puts a few different numbers of bit cells between
+ * pulses:
+ *
+ *   FM:      1 or 2 (a clock pulse in every cell pair, plus data)
+ *   MFM:     2, 3 or 4
+ *   Brother: 1 or 2 (the GCR codes never have two zeroes in a row)
+ *
+ * So the histogram of intervals has a peak for each, and the ratios between
+ * the peaks tell MFM from the others. That leaves FM and Brother looking
+ * alike; but in FM, a one bit is a pair of short intervals (clock to data,
+ * then data to clock), so runs of short intervals always come in even
+ * lengths, and in GCR they don't.
+ */
+
+struct EncodingSignature
+{
+    int encoding;
+    std::vector<int> cells;
+};
+
+static const std::vector<EncodingSignature> signatures =
+{
+    { ENCODING_FM,      { 1, 2 } },
+    { ENCODING_MFM,     { 2, 3, 4 } },
+    { ENCODING_BROTHER, { 1, 2 } },
+};
+
+/* A peak this far from a multiple of the cell, in cells, doesn't fit. */
+#define PEAK_TOLERANCE 0.25
+
+/* This many odd runs of short intervals, or more, means it's not FM. */
+#define ODD_RUN_THRESHOLD 0.2
+
+const std::string encodingToString(int encoding)
+{
+    switch (encoding)
+    {
+        case ENCODING_FM:      return "FM";
+        case ENCODING_MFM:     return "MFM";
+        case ENCODING_BROTHER: return "Brother GCR";
+    }
+    return "unknown";
+}
+
+/*
+ * Returns the fraction of the runs of short intervals (of less than one
+ * and a half cells) which have an odd length.
+ */
+static double odd_short_runs(const Fluxmap& fluxmap, double cellTicks)
+{
+    const uint16_t* p = fluxmap.ptr();
+    unsigned threshold = cellTicks * 1.5;
+    unsigned runs = 0;
+    unsigned oddRuns = 0;
+    unsigned length = 0;
+    for (int i=0; i<fluxmap.size(); i++)
+    {
+        unsigned interval = p[i] ? p[i] : 0xffff;
+        if (interval < threshold)
+            length++;
+        else if (length)
+        {
+            runs++;
+            oddRuns += length & 1;
+            length = 0;
+        }
+    }
+
+    return runs ? ((double)oddRuns / runs) : 0.0;
+}
+
+std::vector<EncodingGuess> guessEncodings(const Fluxmap& fluxmap)
+{
+    std::vector<EncodingGuess> guesses;
+    auto peaks = findFluxPeaks(fluxmap);
+    if (peaks.empty() || !fluxmap.size())
+        return guesses;
+
+    double oddRuns = -1.0;
+    for (const auto& signature : signatures)
+    {
+        /* The first peak is always the shortest run length. */
+        double cellTicks = peaks[0].ticks / signature.cells[0];
+
+        uint64_t explained = 0;
+        unsigned matched = 0;
+        for (int cells : signature.cells)
+        {
+            for (const auto& peak : peaks)
+            {
+                if (fabs(peak.ticks/cellTicks - cells) < PEAK_TOLERANCE)
+                {
+                    explained += peak.count;
+                    matched++;
+                    break;
+                }
+            }
+        }
+
+        /* A run length which never turns up counts heavily against. */
+        double fit = (double)matched / signature.cells.size();
+        double score = (double)explained / fluxmap.size() * fit * fit;
+
+        if (signature.cells[0] == 1)
+        {
+            if (oddRuns < 0.0)
+                oddRuns = odd_short_runs(fluxmap, cellTicks);
+            double gcrness = std::min(1.0, oddRuns / ODD_RUN_THRESHOLD);
+            score *= (signature.encoding == ENCODING_FM) ? (1.0 - gcrness) : gcrness;
+        }
+
+        guesses.push_back({ signature.encoding, (nanoseconds_t)(cellTicks * NS_PER_TICK), score });
+    }
+
+    std::stable_sort(guesses.begin(), guesses.end(),
+        [](const EncodingGuess& a, const EncodingGuess& b)
+        {
+            return a.score > b.score;
+        });
+    return guesses;
+}
@@ -1,18 +1,12 @@
 #include "globals.h"
 #include "fluxmap.h"
+#include "bitstream.h"
 #include "protocol.h"
 #include "record.h"
 #include "decoders.h"
 #include <string.h>
 #include <algorithm>
 
-static size_t cursor;
-static size_t recordstart;
-static std::vector<uint8_t> outputbuffer;
-static uint8_t outputfifo = 0;
-static int bitcount = 0;
-static bool phase = false;
-
 static uint8_t extract_data_bits(uint16_t x)
 {
     x = x & 0x5555;
@@ -22,36 +16,46 @@ static uint8_t extract_data_bits(uint16_t x)
     return x;
 }
 
-static void write_bit(bool bit)
-{
-    outputfifo = (outputfifo << 1) | bit;
-    bitcount++;
-    if (bitcount == 8)
-    {
-        outputbuffer.push_back(outputfifo);
-        bitcount = 0;
-    }
-}
-
-static void add_record(RecordVector& records,
-	nanoseconds_t position, const std::vector<uint8_t>& data)
+static void add_record(RecordVector& records, const std::shared_ptr<RecordArena>& arena,
+	const std::vector<WeakPulse>& weakPulses, nanoseconds_t position,
+	const std::vector<uint8_t>& data)
 {
-	records.push_back(std::unique_ptr<Record>(new Record(position, data)));
+	std::unique_ptr<Record> record(new Record(position, arena->copy(data), arena));
+	addInterleavedWeakBits(*record, weakPulses, position);
+	records.push_back(std::move(record));
 }
 
-nanoseconds_t FmBitmapDecoder::guessClock(Fluxmap& fluxmap) const
+nanoseconds_t FmBitmapDecoder::guessClock(const Fluxmap& fluxmap) const
 {
     return fluxmap.guessClock();
 }
 
-RecordVector FmBitmapDecoder::decodeBitsToRecords(const std::vector<bool>& bits) const
+RecordVector FmBitmapDecoder::decodeBitsToRecords(const Bitstream& bits) const
 {
     RecordVector records;
+    auto arena = RecordArena::create();
 
-    cursor = 0;
+    /* All decoder state is local, so concurrent calls are safe. */
+    size_t cursor = 0;
+    size_t recordstart = 0;
+    std::vector<uint8_t> outputbuffer;
+    uint8_t outputfifo = 0;
+    int bitcount = 0;
+    bool phase = false;
     uint16_t inputfifo = 0;
     bool reading = false;
 
+    auto write_bit = [&](bool bit)
+    {
+        outputfifo = (outputfifo << 1) | bit;
+        bitcount++;
+        if (bitcount == 8)
+        {
+            outputbuffer.push_back(outputfifo);
+            bitcount = 0;
+        }
+    };
+
     while (cursor < bits.size())
     {
         bool bit = bits[cursor++];
@@ -85,7 +89,7 @@ RecordVector FmBitmapDecoder::decodeBitsToRecords(const std::vector<bool>& bits)
         if ((inputfifo == 0xf77a) || (inputfifo == 0xf57e) || (inputfifo == 0xf56f))
         {
             if (reading)
-				add_record(records, recordstart, outputbuffer);
+				add_record(records, arena, bits.weakPulses(), recordstart, outputbuffer);
 			recordstart = cursor - 16;
 
             outputbuffer.resize(1);
@@ -104,8 +108,107 @@ RecordVector FmBitmapDecoder::decodeBitsToRecords(const std::vector<bool>& bits)
     }
 
     if (reading)
-		add_record(records, recordstart, outputbuffer);
+		add_record(records, arena, bits.weakPulses(), recordstart, outputbuffer);
 
     return records;
 }
 
+
+/*
+ * The same as decodeBitsToRecords(), but working from the pulses themselves
+ * rather than a bitstream of the whole track. Two of the marks end in a
+ * missing pulse, so are only known once the next pulse arrives.
+ */
+RecordVector FmBitmapDecoder::decodeFluxToRecords(
+    const Fluxmap& fluxmap, nanoseconds_t clockPeriod) const
+{
+    if (usingPll())
+        return BitmapDecoder::decodeFluxToRecords(fluxmap, clockPeriod);
+
+    RecordVector records;
+    auto arena = RecordArena::create();
+    FluxPulses pulses(fluxmap, clockPeriod);
+    std::vector<WeakPulse> weakPulses;
+    std::vector<uint8_t> outputbuffer;
+    uint64_t fifo = 0;
+    size_t recordstart = 0;
+    bool reading = false;
+    size_t pendingMark = Bitstream::npos;
+    uint16_t pendingPattern = 0;
+
+    /* Each mark is completed by the raw bit at detected. */
+    auto begin = [&](size_t detected, uint16_t pattern)
+    {
+        recordstart = detected - 15;
+        outputbuffer.assign(1, extract_data_bits(pattern));
+        reading = true;
+    };
+
+    /* Only whole bytes before the bit completing the next mark are kept. */
+    auto finish = [&](size_t detected)
+    {
+        size_t count = (detected - recordstart - 16) / 2;
+        outputbuffer.resize(1 + count/8);
+        add_record(records, arena, weakPulses, recordstart, outputbuffer);
+    };
+
+    while (pulses.next())
+    {
+        size_t p = pulses.position;
+        fifo = (pulses.cells >= 64) ? 1 : ((fifo << pulses.cells) | 1);
+        if (abs(pulses.offset) >= WEAK_PULSE_OFFSET)
+            weakPulses.push_back({ p, pulses.offset });
+
+        if (pendingMark != Bitstream::npos)
+        {
+            if (pulses.cells >= 2)
+            {
+                if (reading)
+                    finish(pendingMark);
+                begin(pendingMark, pendingPattern);
+            }
+            pendingMark = Bitstream::npos;
+        }
+
+        if ((fifo & 0xffff) == 0xf56f)
+        {
+            if (reading)
+                finish(p);
+            begin(p, 0xf56f);
+            continue;
+        }
+
+        if (reading && (p > (recordstart + 16)))
+        {
+            size_t o = p - recordstart - 17;
+            if (!(o & 1))
+            {
+                size_t bit = o / 2;
+                size_t byte = 1 + bit/8;
+                if (byte >= outputbuffer.size())
+                    outputbuffer.resize(byte + 1);
+                outputbuffer[byte] |= 0x80 >> (bit % 8);
+            }
+        }
+
+        for (uint16_t pattern : { 0xf77a, 0xf57e })
+        {
+            if ((fifo & 0x7fff) == (pattern >> 1U))
+            {
+                pendingMark = p + 1;
+                pendingPattern = pattern;
+            }
+        }
+    }
+
+    if ((pendingMark != Bitstream::npos) && (pendingMark < pulses.size()))
+    {
+        if (reading)
+            finish(pendingMark);
+        begin(pendingMark, pendingPattern);
+    }
+    if (reading)
+        finish(pulses.size());
+
+    return records;
+}
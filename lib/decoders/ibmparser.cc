@@ -1,4 +1,5 @@
 #include "globals.h"
+#include "flags.h"
 #include "decoders.h"
 #include "sector.h"
 #include "image.h"
@@ -7,15 +8,89 @@
 #include "fmt/format.h"
 #include <string.h>
 #include <arpa/inet.h>
+#include <algorithm>
+
+static IntFlag bitRepairCandidates(
+    { "--bit-repair-candidates" },
+    "Try to repair sectors with bad checksums by flipping one or two of this many of their least certain bits (0 to disable).",
+    0);
 
 static_assert(std::is_trivially_copyable<IbmIdam>::value);
 
+/*
+ * Tries to make raw pass its CRC by flipping one, or failing that two, of
+ * its weakest bits at or after firstBit. A repair is only made if exactly
+ * one combination works. As the CRC of a valid record including its own
+ * CRC is zero, the CRC of raw says which bits must flip; each candidate
+ * bit's contribution to it is computed once, and pairs are then found by
+ * lookup, so the cost grows only linearly with the number of candidates.
+ * Returns the number of bits flipped.
+ */
+static unsigned repair_bits(std::vector<uint8_t>& raw,
+    const std::vector<WeakBit>& weakBits, unsigned firstBit)
+{
+    std::vector<WeakBit> candidates;
+    for (const auto& weakBit : weakBits)
+        if ((weakBit.bit >= firstBit) && (weakBit.bit < (raw.size()*8)))
+            candidates.push_back(weakBit);
+    std::stable_sort(candidates.begin(), candidates.end(),
+        [](const WeakBit& a, const WeakBit& b) { return a.weakness > b.weakness; });
+
+    std::vector<unsigned> bits;
+    for (const auto& candidate : candidates)
+    {
+        if (bits.size() == (unsigned)bitRepairCandidates)
+            break;
+        if (std::find(bits.begin(), bits.end(), candidate.bit) == bits.end())
+            bits.push_back(candidate.bit);
+    }
+
+    uint16_t syndrome = crc16(CCITT_POLY, &raw[0], &raw[0] + raw.size());
+    if (!syndrome)
+        return 0;
+
+    std::map<uint16_t, unsigned> deltas;
+    std::vector<unsigned> fix;
+    for (unsigned i=0; i<bits.size(); i++)
+    {
+        uint16_t delta = crc16FlipBit(CCITT_POLY, 0, raw.size(), bits[i]);
+        if (delta == syndrome)
+            fix.push_back(bits[i]);
+        deltas[delta] = i;
+    }
+
+    if (fix.empty())
+    {
+        unsigned pairs = 0;
+        for (unsigned i=0; i<bits.size(); i++)
+        {
+            uint16_t delta = crc16FlipBit(CCITT_POLY, syndrome, raw.size(), bits[i]);
+            auto j = deltas.find(delta);
+            if ((j != deltas.end()) && (j->second > i))
+            {
+                pairs++;
+                fix = { bits[i], bits[j->second] };
+            }
+        }
+        if (pairs != 1)
+            return 0;
+    }
+    else if (fix.size() != 1)
+        return 0;
+
+    for (unsigned bit : fix)
+        raw[bit / 8] ^= 0x80 >> (bit % 8);
+    return fix.size();
+}
+
 std::vector<std::unique_ptr<Sector>> IbmRecordParser::parseRecordsToSectors(
 		const RecordVector& records) const
 {
     bool idamValid = false;
-    IbmIdam idam;
+    IbmIdam idam = {};
     std::vector<std::unique_ptr<Sector>> sectors;
+    auto arena = RecordArena::create();
+    std::vector<uint8_t> raw;
 
     unsigned prologue;
     switch (_scheme)
@@ -56,21 +131,26 @@ std::vector<std::unique_ptr<Sector>> IbmRecordParser::parseRecordsToSectors(
                     break;
                 
                 unsigned size = 1 << (idam.sectorSize + 7);
-                if (size > (len + IBM_DAM_LEN + 2))
+                if ((IBM_DAM_LEN + size + 2) > len)
                     break;
 
-                const uint8_t* userStart = &data[IBM_DAM_LEN];
-                const uint8_t* userEnd = userStart + size;
-				uint16_t crc = crc16(CCITT_POLY, &datav[0], userEnd);
-				uint16_t wantedCrc = (userEnd[0] << 8) | userEnd[1];
-				int status = (crc == wantedCrc) ? Sector::OK : Sector::BAD_CHECKSUM;
-
-                std::vector<uint8_t> sectordata(size);
-                memcpy(&sectordata[0], userStart, size);
+                /* The checksum covers the prologue and the DAM itself. */
+                const uint8_t* userEnd = &data[IBM_DAM_LEN + size];
+                raw.assign(datav.begin(), userEnd + 2);
+				int status = checkRawSector(raw);
+                unsigned repairedBits = 0;
+                if ((status != Sector::OK) && (bitRepairCandidates > 0))
+                {
+                    repairedBits = repair_bits(raw, record->weakBits, prologue*8);
+                    if (repairedBits)
+                        status = checkRawSector(raw);
+                }
 
                 int sectorNum = idam.sector - _sectorIdBase;
                 auto sector = std::unique_ptr<Sector>(
-					new Sector(status, idam.cylinder, idam.side, sectorNum, sectordata));
+					new Sector(status, idam.cylinder, idam.side, sectorNum, arena->copy(raw),
+                        arena, prologue + IBM_DAM_LEN, size));
+                sector->repairedBits = repairedBits;
                 sectors.push_back(std::move(sector));
                 idamValid = false;
                 break;
@@ -80,3 +160,14 @@ std::vector<std::unique_ptr<Sector>> IbmRecordParser::parseRecordsToSectors(
 
     return sectors;
 }
+
+int IbmRecordParser::checkRawSector(const ByteSpan& raw) const
+{
+    if (raw.size() < 2)
+        return Sector::BAD_CHECKSUM;
+
+    const uint8_t* crcPtr = &raw[raw.size() - 2];
+    uint16_t crc = crc16(CCITT_POLY, &raw[0], crcPtr);
+    uint16_t wantedCrc = (crcPtr[0] << 8) | crcPtr[1];
+    return (crc == wantedCrc) ? Sector::OK : Sector::BAD_CHECKSUM;
+}
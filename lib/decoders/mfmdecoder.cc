@@ -1,107 +1,224 @@
 #include "globals.h"
 #include "fluxmap.h"
+#include "bitstream.h"
 #include "protocol.h"
 #include "record.h"
 #include "decoders.h"
 #include <string.h>
 #include <algorithm>
 
-static size_t cursor;
-static size_t recordstart;
-static std::vector<uint8_t> outputbuffer;
-static uint8_t outputfifo = 0;
-static int bitcount = 0;
-static bool phase = false;
+#define MFM_IAM_PATTERN 0x522452245224LL
+#define MFM_A1_PATTERN  0x448944894489LL
+#define MFM_PATTERN_LEN 48
 
-static void write_bit(bool bit)
+/*
+ * Maps sixteen raw MFM bits (clock, data, clock, data...) onto the eight
+ * data bits they encode.
+ */
+class MfmDataTable
 {
-    outputfifo = (outputfifo << 1) | bit;
-    bitcount++;
-    if (bitcount == 8)
+public:
+    MfmDataTable()
     {
-        outputbuffer.push_back(outputfifo);
-        bitcount = 0;
+        for (unsigned i=0; i<0x10000; i++)
+        {
+            unsigned x = i & 0x5555;
+            x = (x | (x >> 1)) & 0x3333;
+            x = (x | (x >> 2)) & 0x0f0f;
+            x = (x | (x >> 4)) & 0x00ff;
+            _table[i] = x;
+        }
     }
-}
 
-static void add_record(RecordVector& records,
-	nanoseconds_t position, const std::vector<uint8_t>& data)
+    uint8_t operator [] (uint16_t raw) const { return _table[raw]; }
+
+private:
+    uint8_t _table[0x10000];
+};
+
+static const MfmDataTable dataTable;
+
+/* The record's data starts with the bytes encoded by the mark. */
+static void add_record(RecordVector& records, const std::shared_ptr<RecordArena>& arena,
+	const std::vector<WeakPulse>& weakPulses, size_t mark, const ByteSpan& data)
 {
-	records.push_back(std::unique_ptr<Record>(new Record(position, data)));
+	std::unique_ptr<Record> record(new Record(mark + MFM_PATTERN_LEN - 4*3*8, data, arena));
+	addInterleavedWeakBits(*record, weakPulses, mark);
+	records.push_back(std::move(record));
 }
 
-nanoseconds_t MfmBitmapDecoder::guessClock(Fluxmap& fluxmap) const
+nanoseconds_t MfmBitmapDecoder::guessClock(const Fluxmap& fluxmap) const
 {
     return fluxmap.guessClock()/2;
 }
 
-RecordVector MfmBitmapDecoder::decodeBitsToRecords(const std::vector<bool>& bits) const
+RecordVector MfmBitmapDecoder::decodeBitsToRecords(const Bitstream& bits) const
 {
     RecordVector records;
+    auto arena = RecordArena::create();
 
-    cursor = 0;
-    uint64_t inputfifo = 0;
-    bool reading = false;
+    /*
+     * The IAM record, which is the first one on the disk (and is optional), uses
+     * a distorted 0xC2 0xC2 0xC2 marker to identify it. Unfortunately, if this is
+     * shifted out of phase, it becomes a legal encoding, so if we're looking at
+     * real data we can't honour this.
+     *
+     * 0xC2 is:
+     * data:    1  1  0  0  0  0  1 0
+     * mfm:     01 01 00 10 10 10 01 00 = 0x5254
+     * special: 01 01 00 10 00 10 01 00 = 0x5224
+     *                    ^^^^
+     * shifted: 10 10 01 00 01 00 10 0. = legal, and might happen in real data
+     *
+     * Therefore, when we've read the marker, the input fifo will contain
+     * 0xXXXX522252225222.
+     *
+     * All other records use 0xA1 as a marker:
+     *
+     * 0xA1  is:
+     * data:    1  0  1  0  0  0  0  1
+     * mfm:     01 00 01 00 10 10 10 01 = 0x44A9
+     * special: 01 00 01 00 10 00 10 01 = 0x4489
+     *                       ^^^^^
+     * shifted: 10 00 10 01 00 01 00 1
+     *
+     * When this is shifted out of phase, we get an illegal encoding (you
+     * can't do 10 00). So, if we ever see 0x448944894489 in the bitstream, we
+     * know we've landed at the beginning of a new record.
+     *
+     * The marks are searched for a word at a time by Bitstream::find(); each
+     * record then runs up to the end of the next mark, and its data bits are
+     * decoded sixteen raw bits at a time.
+     */
 
-    while (cursor < bits.size())
+    /* An IAM is only honoured if it precedes every other mark. */
+    size_t mark = bits.find(MFM_A1_PATTERN, MFM_PATTERN_LEN);
+    size_t iam = bits.find(MFM_IAM_PATTERN, MFM_PATTERN_LEN, 0, mark);
+    bool isIam = (iam != Bitstream::npos);
+    if (isIam)
+        mark = iam;
+
+    while (mark != Bitstream::npos)
     {
-        bool bit = bits[cursor++];
-        inputfifo = (inputfifo << 1) | bit;
-
-        /* 
-         * The IAM record, which is the first one on the disk (and is optional), uses
-         * a distorted 0xC2 0xC2 0xC2 marker to identify it. Unfortunately, if this is
-         * shifted out of phase, it becomes a legal encoding, so if we're looking at
-         * real data we can't honour this.
-         * 
-         * 0xC2 is:
-         * data:    1  1  0  0  0  0  1 0
-         * mfm:     01 01 00 10 10 10 01 00 = 0x5254
-         * special: 01 01 00 10 00 10 01 00 = 0x5224
-         *                    ^^^^
-         * shifted: 10 10 01 00 01 00 10 0. = legal, and might happen in real data
-         * 
-         * Therefore, when we've read the marker, the input fifo will contain
-         * 0xXXXX522252225222.
-         * 
-         * All other records use 0xA1 as a marker:
-         * 
-         * 0xA1  is:
-         * data:    1  0  1  0  0  0  0  1
-         * mfm:     01 00 01 00 10 10 10 01 = 0x44A9
-         * special: 01 00 01 00 10 00 10 01 = 0x4489
-         *                       ^^^^^
-         * shifted: 10 00 10 01 00 01 00 1
-         * 
-         * When this is shifted out of phase, we get an illegal encoding (you
-         * can't do 10 00). So, if we ever see 0x448944894489 in the input
-         * fifo, we know we've landed at the beginning of a new record.
-         */
-         
-        uint64_t masked = inputfifo & 0xFFFFFFFFFFFFLL;
-        if ((!reading && (masked == 0x522452245224LL)) || (masked == 0x448944894489LL))
+        size_t start = mark + MFM_PATTERN_LEN;
+        size_t next = bits.find(MFM_A1_PATTERN, MFM_PATTERN_LEN, mark + 1);
+
+        /* The final bit of the next mark is never part of this record. */
+        size_t end = (next == Bitstream::npos) ? (bits.size() + 1) : (next + MFM_PATTERN_LEN);
+        size_t databytes = (end - start - 1) / 16;
+
+        /* The length is known up front, so decode straight into the arena. */
+        uint8_t* record = arena->allocate(3 + databytes);
+        std::fill(record, record+3, isIam ? 0xC2 : 0xA1);
+        uint8_t* p = record + 3;
+        size_t i = 0;
+        for (; (i+4) <= databytes; i += 4)
         {
-            if (reading)
-				add_record(records, recordstart, outputbuffer);
-			recordstart = cursor - 4*3*8;
+            uint64_t raw = bits.word(start + i*16);
+            *p++ = dataTable[raw >> 48];
+            *p++ = dataTable[(raw >> 32) & 0xffff];
+            *p++ = dataTable[(raw >> 16) & 0xffff];
+            *p++ = dataTable[raw & 0xffff];
+        }
+        for (; i<databytes; i++)
+            *p++ = dataTable[bits.get(start + i*16, 16)];
 
-            outputbuffer.resize(3);
-            std::fill(outputbuffer.begin(), outputbuffer.begin()+3, reading ? 0xA1 : 0xC2);
+        add_record(records, arena, bits.weakPulses(), mark, ByteSpan(record, 3 + databytes));
+
+        mark = next;
+        isIam = false;
+    }
 
-            reading = true;
-            bitcount = 0;
-            phase = 0;
+    return records;
+}
+
+/*
+ * The same as decodeBitsToRecords(), but working from the pulses themselves:
+ * the last 64 raw bits are kept in a shift register to spot the marks, and
+ * each pulse in a data cell sets its bit of the current record directly.
+ * Zero bits cost nothing, and no bitstream for the whole track is built.
+ */
+RecordVector MfmBitmapDecoder::decodeFluxToRecords(
+    const Fluxmap& fluxmap, nanoseconds_t clockPeriod) const
+{
+    if (usingPll())
+        return BitmapDecoder::decodeFluxToRecords(fluxmap, clockPeriod);
+
+    RecordVector records;
+    auto arena = RecordArena::create();
+    FluxPulses pulses(fluxmap, clockPeriod);
+    std::vector<WeakPulse> weakPulses;
+    std::vector<uint8_t> outputbuffer;
+    uint64_t fifo = 0;
+    size_t mark = 0;
+    bool reading = false;
+    bool isIam = false;
+    bool seenA1 = false;
+
+    /* The IAM ends with two zeroes, so is only known once the next pulse arrives. */
+    size_t pendingIam = Bitstream::npos;
+
+    auto begin = [&](size_t newMark, bool iam)
+    {
+        mark = newMark;
+        isIam = iam;
+        reading = true;
+        outputbuffer.assign(3, iam ? 0xC2 : 0xA1);
+    };
+
+    /* The final bit of the next mark is never part of this record. */
+    auto finish = [&](size_t end)
+    {
+        size_t start = mark + MFM_PATTERN_LEN;
+        size_t databytes = (end - start - 1) / 16;
+        outputbuffer.resize(3 + databytes);
+        add_record(records, arena, weakPulses, mark, arena->copy(outputbuffer));
+    };
+
+    while (pulses.next())
+    {
+        size_t p = pulses.position;
+        fifo = (pulses.cells >= 64) ? 1 : ((fifo << pulses.cells) | 1);
+        if (abs(pulses.offset) >= WEAK_PULSE_OFFSET)
+            weakPulses.push_back({ p, pulses.offset });
+
+        if (pendingIam != Bitstream::npos)
+        {
+            if (pulses.cells >= 3)
+                begin(pendingIam, true);
+            pendingIam = Bitstream::npos;
+        }
+
+        if (reading)
+        {
+            size_t o = p - mark - MFM_PATTERN_LEN;
+            if ((p >= (mark + MFM_PATTERN_LEN)) && (o & 1))
+            {
+                size_t bit = o / 2;
+                size_t byte = 3 + bit/8;
+                if (byte >= outputbuffer.size())
+                    outputbuffer.resize(byte + 1);
+                outputbuffer[byte] |= 0x80 >> (bit % 8);
+            }
         }
-        else if (reading)
+
+        if ((p >= (MFM_PATTERN_LEN-1)) && ((fifo & 0xffffffffffffLL) == MFM_A1_PATTERN))
         {
-            if (phase)
-                write_bit(bit);
-            phase = !phase;
+            size_t newMark = p - (MFM_PATTERN_LEN-1);
+            if (reading)
+                finish(newMark + MFM_PATTERN_LEN);
+            begin(newMark, false);
+            seenA1 = true;
         }
+        else if (!seenA1 && !reading && (p >= (MFM_PATTERN_LEN-3))
+                && ((fifo & 0x3fffffffffffLL) == (MFM_IAM_PATTERN >> 2)))
+            pendingIam = p - (MFM_PATTERN_LEN-3);
     }
 
+    if ((pendingIam != Bitstream::npos) && ((pendingIam + MFM_PATTERN_LEN) <= pulses.size()))
+        begin(pendingIam, true);
     if (reading)
-		add_record(records, recordstart, outputbuffer);
+        finish(pulses.size() + 1);
 
     return records;
 }
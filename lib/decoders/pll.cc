@@ -0,0 +1,97 @@
+#include "globals.h"
+#include "fluxmap.h"
+#include "bitstream.h"
+#include "protocol.h"
+#include "decoders.h"
+
+/*
+ * A software data separator built around a digital phase-locked loop.
+ *
+ * Each flux pulse is assigned to the bit cell it lands in; how far it lands
+ * from the centre of that cell is the phase error. Part of the error is
+ * corrected straight away by nudging the phase (phaseGain), and part of it
+ * is fed into the clock period itself (frequencyGain), so the loop follows
+ * gradual speed changes across the track rather than relying on a single
+ * clock for the whole revolution.
+ *
+ * The clock is never allowed to wander more than PLL_MAX_DRIFT from the
+ * nominal period, and during long runs of zeros (where there are no pulses
+ * to measure against) it is pulled back towards nominal.
+ *
+ * As with a fixed clock, a pulse less than threshold cells after the last
+ * one is taken to be noise, and is merged into the next.
+ */
+
+#define PLL_MAX_DRIFT 0.10
+#define PLL_MAX_ZEROES 3
+
+Bitstream Fluxmap::decodeToBitsWithPll(nanoseconds_t clockPeriod,
+    double phaseGain, double frequencyGain, double threshold) const
+{
+    double nominal = clockPeriod;
+    double minPeriod = nominal * (1.0 - PLL_MAX_DRIFT);
+    double maxPeriod = nominal * (1.0 + PLL_MAX_DRIFT);
+    double period = nominal;
+
+    Bitstream bitmap(_ticks * NS_PER_TICK / minPeriod + 1);
+    size_t count = 0;
+    int zeroes = 0;
+
+    /* Time of the pending pulse, relative to the end of the current cell. */
+    double flux = 0.0;
+
+    /* Time of the pending pulse since the last one. */
+    double gap = 0.0;
+
+    for (int cursor = 0; cursor < size(); cursor++)
+    {
+        /* A long gap's continuations just push the next pulse further away. */
+        uint16_t interval = (*this)[cursor];
+        if (!interval)
+        {
+            flux += 0xffff * NS_PER_TICK;
+            gap += 0xffff * NS_PER_TICK;
+            continue;
+        }
+        flux += interval * NS_PER_TICK;
+        gap += interval * NS_PER_TICK;
+        if (gap < (period * threshold))
+            continue;
+        gap = 0.0;
+
+        for (;;)
+        {
+            flux -= period;
+            if (flux >= (period / 2))
+            {
+                /* No pulse in this cell. */
+                count++;
+                zeroes++;
+                continue;
+            }
+
+            /* The pulse is in this cell; flux is now its phase error. */
+            int offset = flux * 256 / period;
+            if ((abs(offset) >= WEAK_PULSE_OFFSET) && (count < bitmap.size()))
+                bitmap.addWeakPulse(count, offset);
+
+            if (zeroes <= PLL_MAX_ZEROES)
+                period += flux * frequencyGain;
+            else
+                period += (nominal - period) * frequencyGain;
+            period = std::max(minPeriod, std::min(maxPeriod, period));
+
+            flux -= flux * phaseGain;
+
+            if (count >= bitmap.size())
+                goto abort;
+            bitmap.set(count++, true);
+            zeroes = 0;
+            break;
+        }
+    }
+abort:
+
+    bitmap.resize(std::min(count, bitmap.size()));
+    return bitmap;
+}
@@ -0,0 +1,128 @@
+#include "globals.h"
+#include "sector.h"
+#include "decoders.h"
+#include "voting.h"
+#include <algorithm>
+
+/*
+ * When the two commonest values of a byte get the same number of votes,
+ * there's no telling which is right; up to this many such ties are resolved
+ * by trying every combination of them against the checksum. This is what
+ * lets two bad copies be combined.
+ */
+#define MAX_TIES 12
+
+void SectorVoter::add(std::unique_ptr<Sector> sector)
+{
+    _copies.push_back(std::move(sector));
+}
+
+bool SectorVoter::hasGoodCopy() const
+{
+    for (const auto& sector : _copies)
+        if (sector->status == Sector::OK)
+            return true;
+    return false;
+}
+
+std::unique_ptr<Sector> SectorVoter::vote(const RecordParser& parser) const
+{
+    assert(!_copies.empty());
+    for (const auto& sector : _copies)
+        if (sector->status == Sector::OK)
+            return sector->copy();
+
+    /* Only copies of the commonest length can be lined up with each other. */
+    std::map<size_t, unsigned> lengths;
+    for (const auto& sector : _copies)
+        if (!sector->raw.empty())
+            lengths[sector->raw.size()]++;
+    if (lengths.empty())
+        return _copies.front()->copy();
+    size_t length = std::max_element(lengths.begin(), lengths.end(),
+        [](const std::pair<const size_t, unsigned>& a, const std::pair<const size_t, unsigned>& b)
+        {
+            return a.second < b.second;
+        })->first;
+
+    std::vector<const Sector*> voters;
+    for (const auto& sector : _copies)
+        if (sector->raw.size() == length)
+            voters.push_back(sector.get());
+    const Sector& first = *voters.front();
+    if (voters.size() == 1)
+        return first.copy();
+
+    std::vector<uint8_t> raw(length);
+    std::vector<std::pair<size_t, uint8_t>> ties;
+    unsigned leastVotes = voters.size();
+    for (size_t i=0; i<length; i++)
+    {
+        uint8_t best = first.raw[i];
+        uint8_t runnerUp = best;
+        unsigned bestVotes = 0;
+        unsigned runnerUpVotes = 0;
+        for (size_t j=0; j<voters.size(); j++)
+        {
+            /* Each value is counted at its first appearance only. */
+            uint8_t value = voters[j]->raw[i];
+            bool counted = false;
+            for (size_t k=0; k<j; k++)
+                counted |= (voters[k]->raw[i] == value);
+            if (counted)
+                continue;
+
+            unsigned votes = 1;
+            for (size_t k=j+1; k<voters.size(); k++)
+                votes += (voters[k]->raw[i] == value);
+            if (votes > bestVotes)
+            {
+                runnerUp = best;
+                runnerUpVotes = bestVotes;
+                best = value;
+                bestVotes = votes;
+            }
+            else if (votes > runnerUpVotes)
+            {
+                runnerUp = value;
+                runnerUpVotes = votes;
+            }
+
+            /* Nothing else can beat an outright majority. */
+            if ((bestVotes*2) > voters.size())
+                break;
+        }
+
+        raw[i] = best;
+        leastVotes = std::min(leastVotes, bestVotes);
+        if (runnerUpVotes == bestVotes)
+            ties.push_back(std::make_pair(i, runnerUp));
+    }
+
+    int status = parser.checkRawSector(raw);
+    if ((status != Sector::OK) && !ties.empty() && (ties.size() <= MAX_TIES))
+    {
+        std::vector<uint8_t> candidate;
+        for (unsigned mask=1; mask < (1U << ties.size()); mask++)
+        {
+            candidate = raw;
+            for (unsigned t=0; t<ties.size(); t++)
+                if (mask & (1U << t))
+                    candidate[ties[t].first] = ties[t].second;
+            if (parser.checkRawSector(candidate) == Sector::OK)
+            {
+                raw = candidate;
+                status = Sector::OK;
+                break;
+            }
+        }
+    }
+
+    assert((first.dataOffset + first.data.size()) <= length);
+    std::unique_ptr<Sector> sector(
+        new Sector(status, first.track, first.side, first.sector, std::move(raw),
+            first.dataOffset, first.data.size()));
+    sector->copies = voters.size();
+    sector->confidence = (double)leastVotes / voters.size();
+    return sector;
+}
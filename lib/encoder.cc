@@ -1,26 +1,42 @@
 #include "globals.h"
 #include "fluxmap.h"
+#include "bitstream.h"
 #include "protocol.h"
+#include <algorithm>
 
-Fluxmap& Fluxmap::appendBits(const std::vector<bool>& bits, nanoseconds_t clock)
+Fluxmap& Fluxmap::appendBits(const Bitstream& bits, nanoseconds_t clock)
 {
-	nanoseconds_t now = duration();
-	for (unsigned i=0; i<bits.size(); i++)
+	uint64_t ticks = this->ticks();
+	int64_t start = ticks * NS_PER_TICK;
+	const auto& words = bits.words();
+
+	/* Build all the intervals first, and append them in one go. */
+	std::vector<uint16_t> intervals;
+
+	/* Walk the set bits a word at a time rather than testing every bit. */
+	for (size_t w=0; w<words.size(); w++)
 	{
-		now += clock;
-		if (bits[i])
+		uint64_t word = words[w];
+		while (word)
 		{
-			unsigned delta = (now - duration()) / NS_PER_TICK;
-			while (delta > 255)
+			int bit = __builtin_clzll(word);
+			word &= ~(1ULL << (63 - bit));
+
+			size_t i = w*64 + bit;
+			int64_t now = start + (int64_t)(i+1)*clock;
+			unsigned delta = (now - (int64_t)(ticks * NS_PER_TICK)) / NS_PER_TICK;
+			delta = std::max(delta, 1U);
+			ticks += delta;
+			while (delta > 0xffff)
 			{
-				appendIntervals({ 255 });
-				delta -= 255;
+				intervals.push_back(0);
+				delta -= 0xffff;
 			}
-			appendIntervals({ (uint8_t)delta });
+			intervals.push_back(delta);
 		}
 	}
 
-	return *this;
+	return appendIntervals(std::move(intervals));
 }
 
 
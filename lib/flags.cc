@@ -79,6 +79,14 @@ void Flag::parseFlags(int argc, const char* argv[])
         
 }
 
+Flag* Flag::find(const std::string& name)
+{
+    auto flag = flags_by_name.find(name);
+    if (flag == flags_by_name.end())
+        return NULL;
+    return flag->second;
+}
+
 void BoolFlag::set(const std::string& value)
 {
 	if ((value == "true") || (value == "y"))
@@ -8,6 +8,9 @@ class Flag
 public:
     static void parseFlags(int argc, const char* argv[]);
 
+    /* Returns the flag with this name, or NULL if there isn't one. */
+    static Flag* find(const std::string& name);
+
     Flag(const std::vector<std::string>& names, const std::string helptext);
     virtual ~Flag() {};
 
@@ -17,6 +20,7 @@ public:
 
     virtual bool hasArgument() const = 0;
     virtual const std::string defaultValueAsString() const = 0;
+    virtual const std::string valueAsString() const = 0;
     virtual void set(const std::string& value) = 0;
 
 private:
@@ -35,6 +39,7 @@ public:
 
     bool hasArgument() const { return false; }
     const std::string defaultValueAsString() const { return ""; }
+    const std::string valueAsString() const { return ""; }
     void set(const std::string& value) { _callback(); }
 
 private:
@@ -52,6 +57,7 @@ public:
 
     bool hasArgument() const { return false; }
     const std::string defaultValueAsString() const { return "false"; }
+    const std::string valueAsString() const { return _value ? "true" : "false"; }
     void set(const std::string& value) { _value = true; }
 
 private:
@@ -86,6 +92,7 @@ public:
     {}
 
     const std::string defaultValueAsString() const { return defaultValue; }
+    const std::string valueAsString() const { return value; }
     void set(const std::string& value) { this->value = value; }
 };
 
@@ -98,6 +105,7 @@ public:
     {}
 
     const std::string defaultValueAsString() const { return std::to_string(defaultValue); }
+    const std::string valueAsString() const { return std::to_string(value); }
     void set(const std::string& value) { this->value = std::stoi(value); }
 };
 
@@ -110,6 +118,7 @@ public:
     {}
 
     const std::string defaultValueAsString() const { return std::to_string(defaultValue); }
+    const std::string valueAsString() const { return std::to_string(value); }
     void set(const std::string& value) { this->value = std::stod(value); }
 };
 
@@ -122,6 +131,7 @@ public:
     {}
 
     const std::string defaultValueAsString() const { return defaultValue ? "true" : "false"; }
+    const std::string valueAsString() const { return value ? "true" : "false"; }
     void set(const std::string& value);
 };
 
@@ -2,33 +2,318 @@
 #include "fluxmap.h"
 #include "protocol.h"
 
-Fluxmap& Fluxmap::appendIntervals(const std::vector<uint8_t>& intervals)
+#include <algorithm>
+#include <limits>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define TIME_INDEX_STEP 256
+
+/* A lane of the sum gains at most 0x1fffe a pass, so this many can't overflow it. */
+#define COUNT_TICKS_PASSES 0x8000
+
+/*
+ * Sums the intervals, counting zeroes as 0xffff. Or-ing each interval with
+ * a mask of whether it's zero makes that substitution, after which SSE2 can
+ * add them up eight at a time in 32-bit lanes, which are emptied into the
+ * total every so often.
+ */
+static uint64_t count_ticks(const uint16_t* ptr, size_t len)
+{
+    uint64_t ticks = 0;
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    size_t whole = len & ~(size_t)7;
+    while (i < whole)
+    {
+        size_t stop = std::min(whole, i + 8*COUNT_TICKS_PASSES);
+        __m128i sum = zero;
+        for (; i<stop; i += 8)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(ptr + i));
+            v = _mm_or_si128(v, _mm_cmpeq_epi16(v, zero));
+            sum = _mm_add_epi32(sum,
+                _mm_add_epi32(_mm_unpacklo_epi16(v, zero), _mm_unpackhi_epi16(v, zero)));
+        }
+
+        uint32_t lanes[4];
+        _mm_storeu_si128((__m128i*)lanes, sum);
+        ticks += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+#endif
+
+    for (; i<len; i++)
+        ticks += ptr[i] ? ptr[i] : 0xffff;
+    return ticks;
+}
+
+/* nanoseconds_t only reaches about 2.1 seconds; anything longer saturates. */
+static nanoseconds_t ticks_to_ns(uint64_t ticks)
+{
+    return std::min<double>(ticks * NS_PER_TICK,
+        std::numeric_limits<nanoseconds_t>::max());
+}
+
+nanoseconds_t Fluxmap::duration() const
+{
+    return ticks_to_ns(_ticks);
+}
+
+void Fluxmap::copyIntervals()
+{
+    if (!_intervals)
+        _intervals = std::make_shared<std::vector<uint16_t>>();
+    else
+    {
+        _intervals = std::make_shared<std::vector<uint16_t>>(
+            _intervals->begin() + _start, _intervals->begin() + _start + _length);
+        _start = 0;
+    }
+}
+
+Fluxmap& Fluxmap::appendIntervals(const std::vector<uint16_t>& intervals)
+{
+    return appendIntervals(intervals.data(), intervals.size());
+}
+
+Fluxmap& Fluxmap::appendIntervals(const uint16_t* ptr, size_t len)
+{
+    unshare();
+    _timeIndex.reset();
+    _intervals->insert(_intervals->end(), ptr, ptr + len);
+    _length += len;
+    _ticks += count_ticks(ptr, len);
+    return *this;
+}
+
+/* Takes over the buffer rather than copying it, if the map is empty. */
+Fluxmap& Fluxmap::appendIntervals(std::vector<uint16_t>&& intervals)
+{
+    _ticks += count_ticks(intervals.data(), intervals.size());
+    _timeIndex.reset();
+
+    if (_length == 0)
+    {
+        _length = intervals.size();
+        _start = 0;
+        _intervals = std::make_shared<std::vector<uint16_t>>(std::move(intervals));
+    }
+    else
+    {
+        unshare();
+        _intervals->insert(_intervals->end(), intervals.begin(), intervals.end());
+        _length += intervals.size();
+    }
+    return *this;
+}
+
+Fluxmap& Fluxmap::appendBytes(const uint8_t* ptr, size_t len,
+    const std::vector<size_t>& indexPositions)
+{
+    unshare();
+    _timeIndex.reset();
+    std::vector<uint16_t>& intervals = *_intervals;
+
+    /* A mark in a run of zeroes goes before the interval they're part of. */
+    auto mark = indexPositions.begin();
+    for (size_t i=0; i<len; i++)
+    {
+        for (; (mark != indexPositions.end()) && (*mark <= i); mark++)
+            addIndexMark();
+
+        if (!ptr[i])
+        {
+            _byteOverflow += 0x100;
+            continue;
+        }
+
+        unsigned ticks = _byteOverflow + ptr[i];
+        _byteOverflow = 0;
+        _ticks += ticks;
+        for (; ticks > 0xffff; ticks -= 0xffff)
+        {
+            intervals.push_back(0);
+            _length++;
+        }
+        intervals.push_back(ticks);
+        _length++;
+    }
+    for (; mark != indexPositions.end(); mark++)
+        addIndexMark();
+
+    return *this;
+}
+
+/*
+ * Zero bytes only add whole multiples of 0x100 ticks, and the last byte of
+ * an interval can't be zero, so an interval which is a multiple of 0x100 is
+ * written a tick short, and the tick is added to the next one.
+ */
+std::vector<uint8_t> Fluxmap::toBytes(std::vector<size_t>* indexPositions) const
 {
-    return appendIntervals(&intervals[0], intervals.size());
+    std::vector<uint8_t> bytes;
+    bytes.reserve(_length);
+
+    unsigned mark = 0;
+    uint64_t ticks = 0;
+    for (size_t i=0; i<=_length; i++)
+    {
+        for (; (mark < _indexMarks.size()) && (_indexMarks[mark].position == i); mark++)
+            if (indexPositions && !_indexMarks[mark].estimated)
+                indexPositions->push_back(bytes.size());
+        if (i == _length)
+            break;
+
+        uint16_t interval = (*this)[i];
+        if (!interval)
+        {
+            ticks += 0xffff;
+            continue;
+        }
+
+        ticks += interval;
+        for (; ticks > 0x100; ticks -= 0x100)
+            bytes.push_back(0);
+        if (ticks == 0x100)
+        {
+            bytes.push_back(0xff);
+            ticks = 1;
+        }
+        else
+        {
+            bytes.push_back(ticks);
+            ticks = 0;
+        }
+    }
+
+    return bytes;
 }
 
-Fluxmap& Fluxmap::appendIntervals(const uint8_t* ptr, size_t len)
+Fluxmap& Fluxmap::addIndexMark(size_t position, bool estimated)
 {
-    while (len--)
+    assert(position <= _length);
+    size_t from = 0;
+    uint64_t ticks = 0;
+    if (!_indexMarks.empty())
     {
-        uint8_t interval = *ptr++;
-        _ticks += interval ? interval : 0x100;
-        _intervals.push_back(interval);
+        from = _indexMarks.back().position;
+        ticks = _indexMarks.back().ticks;
+        assert(position >= from);
     }
 
-    _duration = _ticks * NS_PER_TICK;
+    ticks += count_ticks(ptr() + from, position - from);
+    _indexMarks.push_back({ position, ticks, estimated });
     return *this;
 }
 
+nanoseconds_t Fluxmap::indexTime(unsigned mark) const
+{
+    return ticks_to_ns(_indexMarks.at(mark).ticks);
+}
+
+/*
+ * Several threads may decode from the same fluxmap; if they all want the
+ * index at once, each builds its own, but only the first one is kept (so
+ * that once an index is there, it stays put).
+ */
+const std::vector<uint64_t>& Fluxmap::timeIndex() const
+{
+    auto index = std::atomic_load(&_timeIndex);
+    if (!index)
+    {
+        auto samples = std::make_shared<std::vector<uint64_t>>();
+        samples->reserve(_length/TIME_INDEX_STEP + 1);
+        uint64_t ticks = 0;
+        for (size_t i=0; i<=_length; i += TIME_INDEX_STEP)
+        {
+            samples->push_back(ticks);
+            ticks += count_ticks(ptr() + i, std::min<size_t>(TIME_INDEX_STEP, _length - i));
+        }
+
+        std::shared_ptr<const std::vector<uint64_t>> expected;
+        index = samples;
+        if (!std::atomic_compare_exchange_strong(&_timeIndex, &expected, index))
+            index = expected;
+    }
+
+    return *index;
+}
+
+uint64_t Fluxmap::ticksAt(size_t index) const
+{
+    assert(index <= _length);
+    if (index == _length)
+        return _ticks;
+
+    size_t sample = index / TIME_INDEX_STEP;
+    size_t from = sample * TIME_INDEX_STEP;
+    return timeIndex()[sample] + count_ticks(ptr() + from, index - from);
+}
+
+size_t Fluxmap::indexAt(uint64_t ticks) const
+{
+    if (ticks > _ticks)
+        return _length;
+    if (ticks == 0)
+        return 0;
+
+    /* Find the last sample before the time, and count on from there. */
+    const auto& samples = timeIndex();
+    size_t sample = std::lower_bound(samples.begin(), samples.end(), ticks) - samples.begin() - 1;
+    uint64_t now = samples[sample];
+    for (size_t i = sample*TIME_INDEX_STEP; i < _length; i++)
+    {
+        uint16_t interval = (*_intervals)[_start + i];
+        now += interval ? interval : 0xffff;
+        if (now >= ticks)
+            return i;
+    }
+    return _length;
+}
+
+Fluxmap Fluxmap::slice(size_t start, size_t end) const
+{
+    assert((start <= end) && (end <= _length));
+
+    Fluxmap fluxmap;
+    fluxmap._intervals = _intervals;
+    fluxmap._start = _start + start;
+    fluxmap._length = end - start;
+
+    uint64_t startTicks = ticksAt(start);
+    for (const auto& mark : _indexMarks)
+    {
+        if ((mark.position >= start) && (mark.position <= end))
+            fluxmap._indexMarks.push_back(
+                { mark.position - start, mark.ticks - startTicks, mark.estimated });
+    }
+    fluxmap._ticks = ticksAt(end) - startTicks;
+    return fluxmap;
+}
+
+Fluxmap Fluxmap::revolution(unsigned revolution) const
+{
+    assert(revolution < revolutions());
+    return slice(_indexMarks[revolution].position, _indexMarks[revolution+1].position);
+}
 
 void Fluxmap::precompensate(int threshold_ticks, int amount_ticks)
 {
-    uint8_t junk = 0xff;
+    uint16_t junk = 0xffff;
 
-    for (unsigned i=0; i<_intervals.size(); i++)
+    unshare();
+    _timeIndex.reset();
+    std::vector<uint16_t>& intervals = *_intervals;
+    for (unsigned i=0; i<intervals.size(); i++)
     {
-        uint8_t& prev = (i == 0) ? junk : _intervals[i-1];
-        uint8_t& curr = _intervals[i];
+        uint16_t& prev = (i == 0) ? junk : intervals[i-1];
+        uint16_t& curr = intervals[i];
+        if (!prev || !curr)
+            continue;
 
         if ((prev <= threshold_ticks) && (curr > threshold_ticks))
         {
@@ -1,43 +1,155 @@
 #ifndef FLUXMAP_H
 #define FLUXMAP_H
 
+class Bitstream;
+
+/*
+ * A sequence of flux intervals, each the number of ticks from one pulse to
+ * the next. A gap too long for one interval is split up, with a zero
+ * standing for 0xffff ticks and no pulse; anything reading the intervals
+ * one at a time needs to allow for that, but it hardly ever happens.
+ *
+ * Flux files and the hardware use an older form with a byte per interval,
+ * where a zero byte adds 0x100 ticks to the next interval; appendBytes()
+ * and toBytes() convert from and to that.
+ *
+ * Fluxmaps can also carry the positions of the index pulses seen while the
+ * flux was captured, which divide it into revolutions. A revolution (or any
+ * other slice) is a fluxmap in its own right but shares the intervals with
+ * the one it came from; the intervals are only copied if one of them is
+ * changed.
+ *
+ * Finding the time of an interval, or the interval at a time, uses an index
+ * of the time at every TIME_INDEX_STEP'th interval, which is built the first
+ * time it's needed and thrown away whenever the intervals change.
+ */
 class Fluxmap
 {
 public:
-    uint8_t operator[](int index) const
+    uint16_t operator[](int index) const
     {
-        return _intervals.at(index);
+        assert((index >= 0) && ((size_t)index < _length));
+        return (*_intervals)[_start + index];
     }
 
-    nanoseconds_t duration() const { return _duration; }
-    int bytes() const { return _intervals.size(); }
+    /* Saturates on fluxmaps longer than a nanoseconds_t can hold; use ticks() for those. */
+    nanoseconds_t duration() const;
+    uint64_t ticks() const { return _ticks; }
+    int size() const { return _length; }
 
-    const uint8_t* ptr() const
+    const uint16_t* ptr() const
 	{
-		if (!_intervals.empty())
-			return &_intervals.at(0);
+		if (_length)
+			return _intervals->data() + _start;
 		return NULL;
 	}
 
-    Fluxmap& appendIntervals(const std::vector<uint8_t>& intervals);
-    Fluxmap& appendIntervals(const uint8_t* ptr, size_t len);
+    Fluxmap& appendIntervals(const std::vector<uint16_t>& intervals);
+    Fluxmap& appendIntervals(const uint16_t* ptr, size_t len);
+    Fluxmap& appendIntervals(std::vector<uint16_t>&& intervals);
+
+    /* Appends a pulse this many ticks after the last one. */
+    Fluxmap& appendInterval(unsigned ticks)
+    {
+        assert(ticks > 0);
+        unshare();
+        _timeIndex.reset();
+        while (ticks > 0xffff)
+        {
+            _intervals->push_back(0);
+            _length++;
+            _ticks += 0xffff;
+            ticks -= 0xffff;
+        }
+        _intervals->push_back(ticks);
+        _length++;
+        _ticks += ticks;
+        return *this;
+    }
 
-    Fluxmap& appendInterval(uint8_t interval)
+    /*
+     * Appends flux in the byte form, which may be split anywhere over
+     * several calls. Index marks are added at the given byte positions.
+     */
+    Fluxmap& appendBytes(const uint8_t* ptr, size_t len,
+        const std::vector<size_t>& indexPositions = {});
+    Fluxmap& appendBytes(const std::vector<uint8_t>& bytes)
     {
-        return appendIntervals(&interval, 1);
+        return appendBytes(bytes.data(), bytes.size());
     }
 
+    /*
+     * Returns the flux in the byte form, and where the index marks fall in
+     * it; estimated ones are left out, so that they're never saved.
+     */
+    std::vector<uint8_t> toBytes(std::vector<size_t>* indexPositions = nullptr) const;
+
+    /*
+     * Records an index pulse just before the interval at position. An
+     * estimated mark is a guess at where a pulse fell rather than one which
+     * was seen; it divides up the revolutions just the same.
+     */
+    Fluxmap& addIndexMark(size_t position, bool estimated = false);
+    Fluxmap& addIndexMark() { return addIndexMark(_length); }
+
+    unsigned indexMarks() const { return _indexMarks.size(); }
+    bool indexEstimated(unsigned mark) const { return _indexMarks.at(mark).estimated; }
+    size_t indexPosition(unsigned mark) const { return _indexMarks.at(mark).position; }
+    nanoseconds_t indexTime(unsigned mark) const;
+
+    /* The number of complete revolutions, between one index mark and the next. */
+    unsigned revolutions() const
+    {
+        return _indexMarks.empty() ? 0 : (_indexMarks.size() - 1);
+    }
+
+    /* The ticks from the start of the map to the start of the interval at index. */
+    uint64_t ticksAt(size_t index) const;
+
+    /* The first interval to end at or after ticks; size() if there isn't one. */
+    size_t indexAt(uint64_t ticks) const;
+
+    Fluxmap revolution(unsigned revolution) const;
+    Fluxmap slice(size_t start, size_t end) const;
+
     nanoseconds_t guessClock() const;
-	std::vector<bool> decodeToBits(nanoseconds_t clock_period) const;
+	Bitstream decodeToBits(nanoseconds_t clock_period) const;
+	Bitstream decodeToBitsWithPll(nanoseconds_t clock_period,
+		double phaseGain, double frequencyGain, double threshold) const;
 
-	Fluxmap& appendBits(const std::vector<bool>& bits, nanoseconds_t clock);
+	Fluxmap& appendBits(const Bitstream& bits, nanoseconds_t clock);
 
 	void precompensate(int threshold_ticks, int amount_ticks);
 
 private:
-    nanoseconds_t _duration = 0;
-    int _ticks = 0;
-    std::vector<uint8_t> _intervals;
+    struct IndexMark
+    {
+        size_t position;
+        uint64_t ticks;
+        bool estimated;
+    };
+
+    /* Makes sure this fluxmap has its intervals to itself. */
+    void unshare()
+    {
+        if (!_intervals || (_start != 0) || (_length != _intervals->size())
+                || (_intervals.use_count() > 1))
+            copyIntervals();
+    }
+
+    void copyIntervals();
+
+    const std::vector<uint64_t>& timeIndex() const;
+
+    std::shared_ptr<std::vector<uint16_t>> _intervals;
+    size_t _start = 0;
+    size_t _length = 0;
+    uint64_t _ticks = 0;
+    std::vector<IndexMark> _indexMarks;
+    mutable std::shared_ptr<const std::vector<uint64_t>> _timeIndex;
+
+    /* Ticks from trailing zero bytes, waiting for the next appendBytes(). */
+    unsigned _byteOverflow = 0;
 };
 
 #endif
@@ -26,13 +26,37 @@ public:
     {
         usbSetDrive(_drive);
         usbSeek(track);
-        return usbRead(side, revolutions);
+        std::unique_ptr<Fluxmap> fluxmap = usbRead(side, revolutions);
+        addIndexMarks(*fluxmap);
+        return fluxmap;
     }
 
     void recalibrate() {
         usbRecalibrate();
     }
 
+private:
+    /*
+     * The firmware doesn't report index pulses, but it starts reading at
+     * one and stops at another after the right number of revolutions; so
+     * the ones in between can be placed by assuming the disk spins evenly.
+     * Those are only estimates, and are marked as such so that they're
+     * never saved along with the flux.
+     */
+    void addIndexMarks(Fluxmap& fluxmap)
+    {
+        uint64_t totalTicks = fluxmap.ticks();
+        fluxmap.addIndexMark(0);
+        for (int revolution=1; revolution<revolutions; revolution++)
+        {
+            size_t position = fluxmap.indexAt(totalTicks * revolution / revolutions);
+            if (position == (size_t)fluxmap.size())
+                break;
+            fluxmap.addIndexMark(position + 1, true);
+        }
+        fluxmap.addIndexMark();
+    }
+
 private:
     unsigned _drive;
     unsigned _revolutions;
@@ -6,27 +6,20 @@
 class SqliteFluxReader : public FluxReader
 {
 public:
-    SqliteFluxReader(const std::string& filename)
-    {
-        _indb = sqlOpen(filename, SQLITE_OPEN_READONLY);
-    }
-
-    ~SqliteFluxReader()
-    {
-        if (_indb)
-            sqlClose(_indb);
-    }
+    SqliteFluxReader(const std::string& filename):
+        _indb(filename, SQLITE_OPEN_READONLY)
+    {}
 
 public:
     std::unique_ptr<Fluxmap> readFlux(int track, int side)
     {
-        return sqlReadFlux(_indb, track, side);
+        return _indb.readFlux(track, side);
     }
 
     void recalibrate() {}
 
 private:
-    sqlite3* _indb;
+    SqlFluxStore _indb;
 };
 
 std::unique_ptr<FluxReader> FluxReader::createSqliteFluxReader(const std::string& filename)
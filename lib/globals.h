@@ -13,11 +13,47 @@
 #include <vector>
 #include <set>
 #include <cassert>
+#include <cstring>
 
 typedef int nanoseconds_t;
 
+/* Some bytes which belong to something else, which must outlive this. */
+class ByteSpan
+{
+public:
+    ByteSpan() {}
+
+    ByteSpan(const uint8_t* ptr, size_t size):
+        _ptr(ptr), _size(size)
+    {}
+
+    ByteSpan(const std::vector<uint8_t>& vector):
+        _ptr(vector.data()), _size(vector.size())
+    {}
+
+    const uint8_t* data() const { return _ptr; }
+    size_t size() const { return _size; }
+    bool empty() const { return !_size; }
+    const uint8_t* begin() const { return _ptr; }
+    const uint8_t* end() const { return _ptr + _size; }
+    const uint8_t& operator [] (size_t index) const { return _ptr[index]; }
+
+    std::vector<uint8_t> vector() const { return std::vector<uint8_t>(begin(), end()); }
+
+    bool operator == (const ByteSpan& other) const
+    {
+        return (_size == other._size) && (!_size || !memcmp(_ptr, other._ptr, _size));
+    }
+
+    bool operator != (const ByteSpan& other) const { return !(*this == other); }
+
+private:
+    const uint8_t* _ptr = nullptr;
+    size_t _size = 0;
+};
+
 extern double getCurrentTime();
-extern void hexdump(std::ostream& stream, const std::vector<uint8_t>& buffer);
+extern void hexdump(std::ostream& stream, const ByteSpan& buffer);
 
 class Error
 {
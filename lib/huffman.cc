@@ -0,0 +1,305 @@
+#include "globals.h"
+#include "huffman.h"
+#include <string.h>
+#include <endian.h>
+#include <array>
+#include <queue>
+
+/*
+ * Layout of a compressed buffer:
+ *
+ *   4 bytes    uncompressed length, little endian
+ *   128 bytes  code length of each byte value, one per nibble (0 = unused)
+ *   12 bytes   compressed length of each of the first three streams
+ *   ...        the four streams of codes, packed most significant bit first
+ *   8 bytes    of zero padding, so the decoder can always load a whole word
+ *
+ * The input is split into quarters, each coded as a separate stream, so that
+ * the decoder can work on all four at once; decoding a single stream is one
+ * long chain of dependent loads and shifts.
+ *
+ * Codes are limited to MAX_CODE_LENGTH bits so that one lookup in a table of
+ * 1<<MAX_CODE_LENGTH entries decodes any symbol, and so that four symbols fit
+ * in one 64-bit load.
+ */
+
+#define MAX_CODE_LENGTH 12
+#define STREAMS 4
+#define HEADER_SIZE (4 + 128 + 4*(STREAMS-1))
+#define PADDING 8
+
+typedef std::array<uint8_t, 256> CodeLengths;
+
+static CodeLengths build_code_lengths(const uint8_t* ptr, size_t len)
+{
+    std::array<uint64_t, 256> counts = {};
+    for (size_t i=0; i<len; i++)
+        counts[ptr[i]]++;
+
+    for (;;)
+    {
+        /* Nodes 0-255 are the leaves; the rest are joins. */
+        typedef std::pair<uint64_t, int> Node;
+        std::priority_queue<Node, std::vector<Node>, std::greater<Node>> queue;
+        std::vector<int> parents(256, -1);
+        for (int i=0; i<256; i++)
+            if (counts[i])
+                queue.push(Node(counts[i], i));
+
+        while (queue.size() > 1)
+        {
+            Node a = queue.top(); queue.pop();
+            Node b = queue.top(); queue.pop();
+            int join = parents.size();
+            parents.push_back(-1);
+            parents[a.second] = parents[b.second] = join;
+            queue.push(Node(a.first + b.first, join));
+        }
+
+        CodeLengths lengths = {};
+        unsigned maxLength = 0;
+        for (int i=0; i<256; i++)
+        {
+            if (!counts[i])
+                continue;
+
+            unsigned length = 0;
+            for (int node = i; parents[node] != -1; node = parents[node])
+                length++;
+
+            /* A lone symbol still needs a code. */
+            lengths[i] = std::max(length, 1U);
+            maxLength = std::max(maxLength, (unsigned)lengths[i]);
+        }
+
+        if (maxLength <= MAX_CODE_LENGTH)
+            return lengths;
+
+        /* Too deep; flatten the distribution and try again. */
+        for (auto& count : counts)
+            if (count)
+                count = (count >> 1) | 1;
+    }
+}
+
+/* Assigns canonical codes: shorter first, then in symbol order. */
+static std::array<uint16_t, 256> build_codes(const CodeLengths& lengths)
+{
+    std::array<uint16_t, 256> codes = {};
+    unsigned code = 0;
+    for (unsigned length = 1; length <= MAX_CODE_LENGTH; length++)
+    {
+        for (int i=0; i<256; i++)
+            if (lengths[i] == length)
+                codes[i] = code++;
+        code <<= 1;
+    }
+    return codes;
+}
+
+static void write_le32(uint8_t* p, uint32_t value)
+{
+    value = htole32(value);
+    memcpy(p, &value, 4);
+}
+
+static uint32_t read_le32(const uint8_t* p)
+{
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return le32toh(value);
+}
+
+std::vector<uint8_t> huffmanCompress(const uint8_t* ptr, size_t len)
+{
+    if (len > UINT32_MAX)
+        Error() << "too much data to compress";
+
+    CodeLengths lengths = build_code_lengths(ptr, len);
+    auto codes = build_codes(lengths);
+
+    std::vector<uint8_t> output(HEADER_SIZE);
+    write_le32(&output[0], len);
+    for (int i=0; i<256; i += 2)
+        output[4 + i/2] = (lengths[i] << 4) | lengths[i+1];
+
+    size_t quarter = (len + STREAMS - 1) / STREAMS;
+    for (int stream = 0; stream < STREAMS; stream++)
+    {
+        size_t start = output.size();
+        uint64_t fifo = 0;
+        unsigned bits = 0;
+        for (size_t i = stream*quarter; i < std::min(len, (stream+1)*quarter); i++)
+        {
+            uint8_t symbol = ptr[i];
+            fifo = (fifo << lengths[symbol]) | codes[symbol];
+            bits += lengths[symbol];
+            while (bits >= 8)
+            {
+                bits -= 8;
+                output.push_back(fifo >> bits);
+            }
+        }
+        if (bits)
+            output.push_back(fifo << (8 - bits));
+
+        if (stream != (STREAMS-1))
+            write_le32(&output[4 + 128 + 4*stream], output.size() - start);
+    }
+
+    output.resize(output.size() + PADDING);
+    return output;
+}
+
+/*
+ * One stream being decoded. A load just past the end of a stream is
+ * harmless, as there's always another stream or the padding after it; but
+ * a decode can take pos well past the end, so every decode must be checked
+ * before the stream is loaded from again.
+ */
+struct HuffmanStream
+{
+    const uint8_t* data;
+    size_t pos;
+    size_t limit;
+    uint8_t* out;
+    uint8_t* end;
+
+    uint64_t load() const
+    {
+        uint64_t word;
+        memcpy(&word, data + (pos >> 3), 8);
+        return be64toh(word) << (pos & 7);
+    }
+
+    /*
+     * Zero-length entries mark unused codes; they're only checked for once
+     * per load.
+     */
+    template <int N>
+    bool decode(const uint16_t* lookup)
+    {
+        /* Work on copies; stores through out could alias the members. */
+        uint64_t word = load();
+        size_t p = pos;
+        uint8_t* o = out;
+        unsigned bad = 0;
+        for (int i=0; i<N; i++)
+        {
+            uint16_t entry = lookup[word >> (64 - MAX_CODE_LENGTH)];
+            word <<= entry >> 8;
+            p += entry >> 8;
+            bad |= (entry < 0x100);
+            *o++ = entry;
+        }
+        pos = p;
+        out = o;
+        return !bad && (p <= limit);
+    }
+};
+
+std::vector<uint8_t> huffmanDecompress(const uint8_t* ptr, size_t len)
+{
+    if (len < (HEADER_SIZE + PADDING))
+        Error() << "compressed data is truncated";
+
+    /* Every symbol takes at least a bit. */
+    uint32_t outputLength = read_le32(ptr);
+    if (outputLength > ((len - HEADER_SIZE) * 8))
+        Error() << "compressed data is corrupt";
+
+    CodeLengths lengths;
+    for (int i=0; i<256; i += 2)
+    {
+        lengths[i] = ptr[4 + i/2] >> 4;
+        lengths[i+1] = ptr[4 + i/2] & 0x0f;
+    }
+    auto codes = build_codes(lengths);
+
+    /*
+     * Each entry is the symbol in the bottom byte and the code length above
+     * it. Entries no code maps to have length zero.
+     */
+    std::vector<uint16_t> table(1 << MAX_CODE_LENGTH);
+    unsigned used = 0;
+    for (int i=0; i<256; i++)
+    {
+        unsigned length = lengths[i];
+        if (!length)
+            continue;
+        if (length > MAX_CODE_LENGTH)
+            Error() << "compressed data has a bad code table";
+
+        unsigned span = 1 << (MAX_CODE_LENGTH - length);
+        unsigned first = codes[i] << (MAX_CODE_LENGTH - length);
+        used += span;
+        if (used > table.size())
+            Error() << "compressed data has a bad code table";
+        for (unsigned j=0; j<span; j++)
+            table[first + j] = (length << 8) | i;
+    }
+    const uint16_t* lookup = &table[0];
+
+    std::vector<uint8_t> output(outputLength);
+    size_t quarter = (outputLength + STREAMS - 1) / STREAMS;
+    size_t offset = HEADER_SIZE;
+    HuffmanStream streams[STREAMS];
+    for (int i=0; i<STREAMS; i++)
+    {
+        HuffmanStream& s = streams[i];
+        size_t size = (i == (STREAMS-1))
+            ? (len - PADDING - offset)
+            : read_le32(ptr + 4 + 128 + 4*i);
+        if ((offset + size) > (len - PADDING))
+            Error() << "compressed data is truncated";
+
+        s.data = ptr + offset;
+        s.pos = 0;
+        s.limit = size * 8;
+        s.out = output.data() + std::min<size_t>(outputLength, i*quarter);
+        s.end = output.data() + std::min<size_t>(outputLength, (i+1)*quarter);
+        offset += size;
+    }
+
+    /*
+     * The last stream is the shortest. Working on local copies of the
+     * streams lets the compiler keep them all in registers.
+     */
+    static_assert(STREAMS == 4, "the main loop assumes four streams");
+    bool ok = true;
+    {
+        HuffmanStream s0 = streams[0];
+        HuffmanStream s1 = streams[1];
+        HuffmanStream s2 = streams[2];
+        HuffmanStream s3 = streams[3];
+        while ((s3.end - s3.out) >= 4)
+        {
+            ok &= s0.decode<4>(lookup);
+            ok &= s1.decode<4>(lookup);
+            ok &= s2.decode<4>(lookup);
+            ok &= s3.decode<4>(lookup);
+            if (!ok)
+                Error() << "compressed data is corrupt";
+        }
+        streams[0] = s0;
+        streams[1] = s1;
+        streams[2] = s2;
+        streams[3] = s3;
+    }
+
+    for (HuffmanStream& s : streams)
+    {
+        while ((s.end - s.out) >= 4)
+        {
+            if (!s.decode<4>(lookup))
+                Error() << "compressed data is corrupt";
+        }
+        while (s.out < s.end)
+        {
+            if (!s.decode<1>(lookup))
+                Error() << "compressed data is corrupt";
+        }
+    }
+
+    return output;
+}
@@ -0,0 +1,16 @@
+#ifndef HUFFMAN_H
+#define HUFFMAN_H
+
+/*
+ * A byte-oriented canonical Huffman coder, used to squash flux data: the
+ * intervals cluster tightly around a few clock multiples, so they compress
+ * well with nothing more than an order-0 model.
+ *
+ * The compressed form carries its own length and code table. Decompression
+ * throws an Error on anything malformed rather than reading out of bounds.
+ */
+
+extern std::vector<uint8_t> huffmanCompress(const uint8_t* ptr, size_t len);
+extern std::vector<uint8_t> huffmanDecompress(const uint8_t* ptr, size_t len);
+
+#endif
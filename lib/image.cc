@@ -2,10 +2,16 @@
 #include "image.h"
 #include "sector.h"
 #include "sectorset.h"
+#include "record.h"
+#include "mappedfile.h"
 #include "fmt/format.h"
 #include <algorithm>
 #include <iostream>
-#include <fstream>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
 
 Geometry guessGeometry(const SectorSet& sectors)
 {
@@ -17,9 +23,7 @@ Geometry guessGeometry(const SectorSet& sectors)
 void readSectorsFromFile(SectorSet& sectors, const Geometry& geometry,
 		const std::string& filename)
 {
-    std::ifstream inputFile(filename, std::ios::in | std::ios::binary);
-    if (!inputFile.is_open())
-		Error() << "cannot open input file";
+	MappedFile inputFile(filename);
 
     size_t headSize = geometry.sectors * geometry.sectorSize;
     size_t trackSize = headSize * geometry.heads;
@@ -30,25 +34,36 @@ void readSectorsFromFile(SectorSet& sectors, const Geometry& geometry,
 					geometry.tracks * trackSize / 1024)
 			  << std::endl;
 
-	std::vector<uint8_t> data(geometry.sectorSize);
+	/*
+	 * Anything past the end of the file reads as zeroes. The sectors all
+	 * share one arena, which takes a block for every few tracks.
+	 */
+	auto arena = RecordArena::create();
 	for (int track = 0; track < geometry.tracks; track++)
 	{
 		for (int head = 0; head < geometry.heads; head++)
 		{
 			for (int sectorId = 0; sectorId < geometry.sectors; sectorId++)
 			{
-				inputFile.seekg(track*trackSize + head*headSize + sectorId*geometry.sectorSize, std::ios::beg);
-				inputFile.read((char*) &data[0], geometry.sectorSize);
+				size_t offset = track*trackSize + head*headSize + sectorId*geometry.sectorSize;
+				uint8_t* data = arena->allocate(geometry.sectorSize);
+				size_t len = 0;
+				if (offset < inputFile.size())
+				{
+					len = std::min<size_t>(inputFile.size() - offset, geometry.sectorSize);
+					memcpy(data, inputFile.data() + offset, len);
+				}
+				memset(data + len, 0, geometry.sectorSize - len);
 
 				sectors.get(track, head, sectorId).reset(
-					new Sector(Sector::OK, track, head, sectorId, data));
+					new Sector(Sector::OK, track, head, sectorId,
+						ByteSpan(data, geometry.sectorSize), arena));
 			}
 		}
 	}
 }
 
-void writeSectorsToFile(const SectorSet& sectors, const Geometry& geometry,
-		const std::string& filename)
+void showSectorMap(const SectorSet& sectors, const Geometry& geometry)
 {
 	/* Emit the map. */
 
@@ -105,24 +120,126 @@ void writeSectorsToFile(const SectorSet& sectors, const Geometry& geometry,
 					geometry.sectors, geometry.sectorSize,
 					geometry.tracks * trackSize / 1024)
 			  << std::endl;
+}
 
-    std::ofstream outputFile(filename, std::ios::out | std::ios::binary);
-    if (!outputFile.is_open())
-		Error() << "cannot open output file";
+void writeSectorsToFile(const SectorSet& sectors, const Geometry& geometry,
+		const std::string& filename)
+{
+	showSectorMap(sectors, geometry);
 
+	ImageWriter writer(filename, geometry);
 	for (int track = 0; track < geometry.tracks; track++)
-	{
 		for (int head = 0; head < geometry.heads; head++)
+			writer.writeTrack(sectors, track, head);
+	writer.close();
+}
+
+ImageWriter::ImageWriter(const std::string& filename, const Geometry& geometry):
+	_geometry(geometry)
+{
+	_fd = open(filename.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	if (_fd == -1)
+		Error() << "cannot open output file";
+}
+
+ImageWriter::~ImageWriter()
+{
+	if (_fd != -1)
+		::close(_fd);
+}
+
+void ImageWriter::writeTrack(const SectorSet& sectors, int track, int head)
+{
+	if (!_geometry.sectors)
+	{
+		for (int sectorId = 0; sectorId < 256; sectorId++)
 		{
-			for (int sectorId = 0; sectorId < geometry.sectors; sectorId++)
+			auto sector = sectors.get(track, head, sectorId);
+			if (sector)
 			{
-				auto sector = sectors.get(track, head, sectorId);
-				if (sector)
-				{
-					outputFile.seekp(sector->track*trackSize + sector->side*headSize + sector->sector*geometry.sectorSize, std::ios::beg);
-					outputFile.write((const char*) &sector->data[0], sector->data.size());
-				}
+				_geometry.sectors = sectorId + 1;
+				_geometry.sectorSize = std::max(_geometry.sectorSize, (int)sector->data.size());
 			}
 		}
 	}
+
+	if ((track < _nextTrack) || (track >= _geometry.tracks) || (head >= _geometry.heads))
+		return;
+
+	/* Until the geometry's known, sides can only be blank. */
+	PendingTrack& pending = _pending[track];
+	pending.heads |= 1 << head;
+	if (!_geometry.sectors)
+		return;
+
+	size_t headSize = _geometry.sectors * _geometry.sectorSize;
+	pending.data.resize(headSize * _geometry.heads);
+	for (int sectorId = 0; sectorId < _geometry.sectors; sectorId++)
+	{
+		auto sector = sectors.get(track, head, sectorId);
+		if (sector)
+			memcpy(&pending.data[head*headSize + sectorId*_geometry.sectorSize],
+				sector->data.data(), std::min(sector->data.size(), (size_t)_geometry.sectorSize));
+	}
+	flush();
+}
+
+void ImageWriter::close()
+{
+	for (int track = _nextTrack; track < _geometry.tracks; track++)
+		_pending[track].heads = (1 << _geometry.heads) - 1;
+	flush();
+
+	if (::close(_fd) == -1)
+		Error() << "I/O error writing output file";
+	_fd = -1;
+}
+
+/*
+ * Writes out every complete track following on from the last one written,
+ * as few system calls as possible.
+ */
+void ImageWriter::flush()
+{
+	if (!_geometry.sectors || !_geometry.sectorSize)
+		return;
+
+	size_t trackSize = _geometry.sectors * _geometry.sectorSize * _geometry.heads;
+	unsigned allHeads = (1 << _geometry.heads) - 1;
+	for (;;)
+	{
+		std::vector<struct iovec> iov;
+		for (auto i = _pending.begin(); (i != _pending.end()) && (iov.size() < IOV_MAX); i++)
+		{
+			if ((i->first != (int)(_nextTrack + iov.size())) || (i->second.heads != allHeads))
+				break;
+			i->second.data.resize(trackSize);
+			iov.push_back({ i->second.data.data(), trackSize });
+		}
+		if (iov.empty())
+			return;
+
+		struct iovec* next = &iov[0];
+		int count = iov.size();
+		while (count)
+		{
+			ssize_t written = writev(_fd, next, count);
+			if (written <= 0)
+				Error() << "I/O error writing output file";
+			while (count && ((size_t)written >= next->iov_len))
+			{
+				written -= next->iov_len;
+				next++;
+				count--;
+			}
+			if (count)
+			{
+				next->iov_base = (uint8_t*)next->iov_base + written;
+				next->iov_len -= written;
+			}
+		}
+
+		for (size_t j=0; j<iov.size(); j++)
+			_pending.erase(_nextTrack++);
+	}
 }
@@ -24,4 +24,42 @@ extern void writeSectorsToFile(
 	const Geometry& geometry,
 	const std::string& filename);
 
+/* Prints the map of good, bad and missing sectors, and the totals. */
+extern void showSectorMap(const SectorSet& sectors, const Geometry& geometry);
+
+/*
+ * Writes an image out in order, a track at a time. Sides may be handed over
+ * in any order; each track is written as soon as it and every track before
+ * it are complete, so the output can be a pipe. If the geometry has no
+ * sectors, the number of sectors and their size are taken from the first
+ * side handed over. Sectors which don't fit the geometry are dropped.
+ */
+class ImageWriter
+{
+public:
+	ImageWriter(const std::string& filename, const Geometry& geometry);
+	~ImageWriter();
+
+	void writeTrack(const SectorSet& sectors, int track, int head);
+
+	/* Writes out any tracks still pending, and blank ones for any never seen. */
+	void close();
+
+	const Geometry& geometry() const { return _geometry; }
+
+private:
+	struct PendingTrack
+	{
+		std::vector<uint8_t> data;
+		unsigned heads = 0;
+	};
+
+	void flush();
+
+	int _fd;
+	Geometry _geometry;
+	int _nextTrack = 0;
+	std::map<int, PendingTrack> _pending;
+};
+
 #endif
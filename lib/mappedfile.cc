@@ -0,0 +1,34 @@
+#include "globals.h"
+#include "mappedfile.h"
+#include "fmt/format.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+MappedFile::MappedFile(const std::string& filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1)
+        Error() << fmt::format("cannot open input file '{}'", filename);
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        Error() << fmt::format("I/O error reading '{}'", filename);
+    _size = st.st_size;
+
+    if (_size)
+    {
+        _data = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (_data == MAP_FAILED)
+            Error() << fmt::format("I/O error reading '{}'", filename);
+        madvise(_data, _size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if (_data)
+        munmap(_data, _size);
+}
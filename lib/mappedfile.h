@@ -0,0 +1,19 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+/* A read-only view of a whole file. */
+class MappedFile
+{
+public:
+    MappedFile(const std::string& filename);
+    ~MappedFile();
+
+    const uint8_t* data() const { return (const uint8_t*) _data; }
+    size_t size() const { return _size; }
+
+private:
+    void* _data = NULL;
+    size_t _size = 0;
+};
+
+#endif
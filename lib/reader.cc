@@ -4,14 +4,22 @@
 #include "fluxreader.h"
 #include "reader.h"
 #include "fluxmap.h"
+#include "protocol.h"
+#include "bitstream.h"
 #include "sql.h"
 #include "dataspec.h"
 #include "decoders.h"
 #include "sector.h"
 #include "sectorset.h"
+#include "voting.h"
 #include "record.h"
 #include "image.h"
 #include "fmt/format.h"
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
 
 static DataSpecFlag source(
     { "--source", "-s" },
@@ -36,7 +44,20 @@ static IntFlag retries(
 	"How many times to retry each track in the event of a read failure.",
 	5);
 
-static sqlite3* outdb;
+static SettableFlag streamImage(
+	{ "--stream-image" },
+	"Write each track to the image as soon as it has been read, rather than at the end; the number of sectors is taken from the first track, and the image may be a pipe.");
+
+static IntFlag decodeThreads(
+	{ "--decode-threads" },
+	"Decode tracks on this many threads while the next track is being read (0 reads and decodes serially).",
+	0);
+
+/* How many tracks the fastest trial candidate may get ahead of the slowest. */
+#define TRIAL_QUEUE_LENGTH 4
+
+static std::unique_ptr<SqlFluxStore> outdb;
+static std::unique_ptr<ImageWriter> imageWriter;
 
 void setReaderDefaultSource(const std::string& source)
 {
@@ -53,9 +74,12 @@ std::unique_ptr<Fluxmap> Track::read()
 	std::cout << fmt::format("{0:>3}.{1}: ", track, side) << std::flush;
 	std::unique_ptr<Fluxmap> fluxmap = _fluxReader->readFlux(track, side);
 	std::cout << fmt::format(
-		"{0} ms in {1} bytes", int(fluxmap->duration()/1e6), fluxmap->bytes()) << std::endl;
+		"{0} ms in {1} intervals", int(fluxmap->ticks() * MS_PER_TICK), fluxmap->size());
+	if (fluxmap->revolutions())
+		std::cout << fmt::format(" over {} revolutions", fluxmap->revolutions());
+	std::cout << std::endl;
 	if (outdb)
-		sqlWriteFlux(outdb, track, side, *fluxmap);
+		outdb->writeFlux(track, side, *fluxmap);
 	return fluxmap;
 }
 
@@ -72,16 +96,8 @@ std::vector<std::unique_ptr<Track>> readTracks()
 
 	if (!destination.value.empty())
 	{
-		outdb = sqlOpen(destination, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+		outdb.reset(new SqlFluxStore(destination, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE));
 		std::cout << "Writing a copy of the flux to " << destination.value << std::endl;
-		sqlPrepareFlux(outdb);
-		sqlStmt(outdb, "BEGIN;");
-		atexit([]()
-			{
-				sqlStmt(outdb, "COMMIT;");
-				sqlClose(outdb);
-			}
-		);
 	}
 
 	std::shared_ptr<FluxReader> fluxreader = FluxReader::create(dataSpec);
@@ -103,103 +119,554 @@ std::vector<std::unique_ptr<Track>> readTracks()
 	return tracks;
 }
 
-void readDiskCommand(
-    const BitmapDecoder& bitmapDecoder, const RecordParser& recordParser,
-    const std::string& outputFilename)
+typedef std::map<int, SectorVoter> TrackSectors;
+
+/*
+ * Decodes one read of a track, adding the sectors found to every copy read
+ * so far; bad sectors are voted on across all their copies. Returns true if
+ * the track is finished with (either because it's good or because we've run
+ * out of retries).
+ */
+static bool decodeTrackAttempt(
+	const BitmapDecoder& bitmapDecoder, const RecordParser& recordParser,
+	const Fluxmap& fluxmap, TrackSectors& readSectors, int retry,
+	bool& failures, const std::string& indent, std::ostream& out)
 {
-	bool failures = false;
-	SectorSet allSectors;
-    for (const auto& track : readTracks())
+	nanoseconds_t clockPeriod = bitmapDecoder.guessClock(fluxmap);
+	out << indent << fmt::format("{:.2f} us clock; ", (double)clockPeriod/1000.0) << std::flush;
+
+	out << fmt::format("{} bytes encoded; ", (size_t)(fluxmap.ticks() * NS_PER_TICK / clockPeriod / 8)) << std::flush;
+
+	auto records = bitmapDecoder.decodeFluxToRecords(fluxmap, clockPeriod);
+	out << records.size() << " records." << std::endl;
+
+	auto sectors = recordParser.parseRecordsToSectors(records);
+	out << "       " << sectors.size() << " sectors; ";
+
+	for (auto& sector : sectors)
+	{
+		if (sector->repairedBits)
+			out << std::endl
+				<< "       Repaired sector " << sector->sector
+				<< " by flipping " << sector->repairedBits << " bit(s); ";
+		readSectors[sector->sector].add(std::move(sector));
+	}
+
+	bool hasBadSectors = false;
+	for (const auto& i : readSectors)
+	{
+		const auto& voter = i.second;
+		if (voter.hasGoodCopy())
+			continue;
+
+		auto sector = voter.vote(recordParser);
+		if (sector->status != Sector::OK)
+		{
+			out << std::endl
+				<< "       Failed to read sector " << sector->sector
+				<< " (" << Sector::statusToString((Sector::Status)sector->status) << ")";
+			hasBadSectors = true;
+		}
+		else
+			out << std::endl
+				<< "       Recovered sector " << sector->sector << " by voting";
+		if (sector->copies > 1)
+			out << fmt::format(" ({} copies, {:.0f}% agreement)",
+				sector->copies, sector->confidence*100.0);
+		out << "; ";
+	}
+
+	if (dumpRecords && (!hasBadSectors || (retry == 0)))
 	{
-		std::map<int, std::unique_ptr<Sector>> readSectors;
+		/*
+		 * The clock can change along the track, so a record's bit position
+		 * is turned back into flux by walking the pulses again, to the first
+		 * one in the record. The PLL's clock can't be followed like that, so
+		 * with it, that's only approximate.
+		 */
+		out << "\nRaw records follow:\n\n";
+		std::unique_ptr<FluxPulses> pulses;
+		for (auto& record : records)
+		{
+			if (!pulses || (pulses->position > record->position))
+				pulses.reset(new FluxPulses(fluxmap, clockPeriod));
+			while ((pulses->position < record->position) && pulses->next())
+				;
+
+			size_t intervals = pulses->intervals();
+			double ms = fluxmap.ticksAt(intervals) * MS_PER_TICK;
+			out << fmt::format("I+{:.3f}ms{}, flux interval {}", ms,
+					BitmapDecoder::usingPll() ? " (approximately)" : "",
+					intervals ? (intervals - 1) : 0)
+				<< std::endl;
+			hexdump(out, record->data);
+			out << std::endl;
+		}
+	}
+
+	if (!hasBadSectors)
+		return true;
+
+	out << std::endl
+		<< "       ";
+	if (retry == 0)
+	{
+		out << "giving up" << std::endl
+			<< "       ";
+		failures = true;
+		return true;
+	}
+
+	out << retry << " retries remaining" << std::endl;
+	return false;
+}
+
+/* Returns the number of good sectors stored. */
+static unsigned storeTrackSectors(const RecordParser& recordParser,
+	TrackSectors& readSectors, SectorSet& allSectors, std::ostream& out)
+{
+	unsigned good = 0;
+	int size = 0;
+	bool printedTrack = false;
+	std::set<std::pair<int, int>> logicalTracks;
+	for (auto& i : readSectors)
+	{
+		auto sector = i.second.vote(recordParser);
+		if (!printedTrack)
+		{
+			out << fmt::format("logical track {}.{}; ", sector->track, sector->side);
+			printedTrack = true;
+		}
+
+		size += sector->data.size();
+		if (sector->status == Sector::OK)
+			good++;
+		logicalTracks.insert(std::make_pair(sector->track, sector->side));
+		allSectors.get(sector->track, sector->side, sector->sector) = std::move(sector);
+	}
+	out << size << " bytes decoded." << std::endl;
+
+	if (imageWriter)
+		for (const auto& i : logicalTracks)
+			imageWriter->writeTrack(allSectors, i.first, i.second);
+	return good;
+}
+
+/*
+ * A fixed-size queue between one producer and any number of consumers. push()
+ * blocks while the queue is full; pop() blocks while it's empty, and returns
+ * false once the queue has been closed and drained.
+ */
+template <typename T>
+class BoundedQueue
+{
+public:
+	BoundedQueue(size_t capacity):
+		_capacity(capacity)
+	{}
+
+	void push(T&& item)
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_notFull.wait(lock, [&] { return _items.size() < _capacity; });
+		_items.push_back(std::move(item));
+		_notEmpty.notify_one();
+	}
+
+	bool pop(T& item)
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_notEmpty.wait(lock, [&] { return !_items.empty() || _closed; });
+		if (_items.empty())
+			return false;
+		item = std::move(_items.front());
+		_items.pop_front();
+		_notFull.notify_one();
+		return true;
+	}
+
+	void close()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_closed = true;
+		_notEmpty.notify_all();
+	}
+
+private:
+	const size_t _capacity;
+	bool _closed = false;
+	std::deque<T> _items;
+	std::mutex _mutex;
+	std::condition_variable _notFull;
+	std::condition_variable _notEmpty;
+};
+
+/*
+ * Holds the first exception thrown on any worker thread, so that it can be
+ * rethrown on the calling thread once all the workers have been joined.
+ */
+class WorkerError
+{
+public:
+	void capture()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (!_error)
+			_error = std::current_exception();
+	}
+
+	bool failed()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		return !!_error;
+	}
+
+	void rethrow()
+	{
+		if (_error)
+			std::rethrow_exception(_error);
+	}
+
+private:
+	std::exception_ptr _error;
+	std::mutex _mutex;
+};
+
+static void readDiskSerially(
+	const BitmapDecoder& bitmapDecoder, const RecordParser& recordParser,
+	const std::vector<std::unique_ptr<Track>>& tracks,
+	SectorSet& allSectors, bool& failures)
+{
+	for (const auto& track : tracks)
+	{
+		TrackSectors readSectors;
 		for (int retry = ::retries; retry >= 0; retry--)
 		{
 			std::unique_ptr<Fluxmap> fluxmap = track->read();
+			if (decodeTrackAttempt(bitmapDecoder, recordParser, *fluxmap,
+					readSectors, retry, failures, "       ", std::cout))
+				break;
+			track->recalibrate();
+		}
 
-			nanoseconds_t clockPeriod = bitmapDecoder.guessClock(*fluxmap);
-			std::cout << fmt::format("       {:.2f} us clock; ", (double)clockPeriod/1000.0) << std::flush;
-
-			auto bitmap = fluxmap->decodeToBits(clockPeriod);
-			std::cout << fmt::format("{} bytes encoded; ", bitmap.size()/8) << std::flush;
+		storeTrackSectors(recordParser, readSectors, allSectors, std::cout);
+	}
+}
 
-			auto records = bitmapDecoder.decodeBitsToRecords(bitmap);
-			std::cout << records.size() << " records." << std::endl;
+/*
+ * The calling thread drives the hardware, reading tracks into a bounded queue
+ * as fast as it can; worker threads decode them. When a track needs
+ * retrying, the worker hands it back to the reader, which does retries in
+ * preference to new tracks (as the head is probably still nearby). An
+ * exception on any thread stops the read, and is rethrown here.
+ */
+static void readDiskPipelined(
+	const BitmapDecoder& bitmapDecoder, const RecordParser& recordParser,
+	const std::vector<std::unique_ptr<Track>>& tracks,
+	SectorSet& allSectors, bool& failures)
+{
+	struct Job
+	{
+		unsigned index;
+		int retry;
+		std::unique_ptr<Fluxmap> fluxmap;
+	};
 
-			auto sectors = recordParser.parseRecordsToSectors(records);
-			std::cout << "       " << sectors.size() << " sectors; ";
+	BoundedQueue<Job> queue(decodeThreads);
+	std::vector<TrackSectors> readSectors(tracks.size());
+	std::deque<std::pair<unsigned, int>> pendingRetries;
+	unsigned finished = 0;
+	std::mutex stateMutex;
+	std::condition_variable stateChanged;
+	std::mutex consoleMutex;
+	WorkerError error;
 
-			for (auto& sector : sectors)
+	std::vector<std::thread> workers;
+	for (int i=0; i<decodeThreads; i++)
+	{
+		workers.push_back(std::thread(
+			[&]()
 			{
-                auto& replacing = readSectors[sector->sector];
-                if (!replacing || (sector->status == Sector::OK))
-                    replacing = std::move(sector);
-			}
+				Job job;
 
-			bool hasBadSectors = false;
-			for (const auto& i : readSectors)
-			{
-                const auto& sector = i.second;
-				if (sector->status != Sector::OK)
+				/* After a failure, keep draining the queue so the reader never blocks. */
+				while (queue.pop(job))
 				{
-					std::cout << std::endl
-							  << "       Failed to read sector " << sector->sector
-                              << " (" << Sector::statusToString((Sector::Status)sector->status) << "); ";
-					hasBadSectors = true;
+					if (error.failed())
+						continue;
+					try
+					{
+						const auto& track = tracks[job.index];
+						std::stringstream out;
+						bool trackFailed = false;
+						bool done = decodeTrackAttempt(bitmapDecoder, recordParser,
+							*job.fluxmap, readSectors[job.index], job.retry, trackFailed,
+							fmt::format("{0:>3}.{1}: ", track->track, track->side), out);
+
+						{
+							std::lock_guard<std::mutex> lock(stateMutex);
+							failures |= trackFailed;
+							if (done)
+							{
+								storeTrackSectors(recordParser, readSectors[job.index], allSectors, out);
+								finished++;
+							}
+							else
+								pendingRetries.push_back(std::make_pair(job.index, job.retry - 1));
+							stateChanged.notify_all();
+						}
+
+						std::lock_guard<std::mutex> lock(consoleMutex);
+						std::cout << out.str() << std::flush;
+					}
+					catch (...)
+					{
+						error.capture();
+						std::lock_guard<std::mutex> lock(stateMutex);
+						stateChanged.notify_all();
+					}
 				}
 			}
+		));
+	}
 
-			if (hasBadSectors)
-				failures = false;
+	unsigned next = 0;
+	for (;;)
+	{
+		unsigned index;
+		int retry;
+		bool isRetry = false;
+		{
+			std::unique_lock<std::mutex> lock(stateMutex);
+			stateChanged.wait(lock,
+				[&] {
+					return !pendingRetries.empty()
+						|| (next < tracks.size())
+						|| (finished == tracks.size())
+						|| error.failed();
+				}
+			);
 
-			if (dumpRecords && (!hasBadSectors || (retry == 0)))
+			if (error.failed())
+				break;
+			if (!pendingRetries.empty())
 			{
-				std::cout << "\nRaw records follow:\n\n";
-				for (auto& record : records)
-				{
-					std::cout << fmt::format("I+{:.3f}ms", (double)(record->position*clockPeriod)/1e6)
-					          << std::endl;
-					hexdump(std::cout, record->data);
-					std::cout << std::endl;
-				}
+				index = pendingRetries.front().first;
+				retry = pendingRetries.front().second;
+				pendingRetries.pop_front();
+				isRetry = true;
 			}
-
-			if (!hasBadSectors)
+			else if (next < tracks.size())
+			{
+				index = next++;
+				retry = ::retries;
+			}
+			else
 				break;
+		}
 
-			std::cout << std::endl
-                      << "       ";
-            if (retry == 0)
-                std::cout << "giving up" << std::endl
-                          << "       ";
-            else
-            {
-				std::cout << retry << " retries remaining" << std::endl;
-                track->recalibrate();
-            }
+		std::unique_ptr<Fluxmap> fluxmap;
+		try
+		{
+			std::lock_guard<std::mutex> lock(consoleMutex);
+			if (isRetry)
+				tracks[index]->recalibrate();
+			fluxmap = tracks[index]->read();
+		}
+		catch (...)
+		{
+			error.capture();
+			break;
 		}
+		queue.push({ index, retry, std::move(fluxmap) });
+	}
+
+	queue.close();
+	for (auto& worker : workers)
+		worker.join();
+	error.rethrow();
+}
+
+void readDiskCommand(
+    const BitmapDecoder& bitmapDecoder, const RecordParser& recordParser,
+    const std::string& outputFilename)
+{
+	readDiskCommand(readTracks(), bitmapDecoder, recordParser, outputFilename);
+}
 
-        int size = 0;
-		bool printedTrack = false;
-        for (auto& i : readSectors)
-        {
-			auto& sector = i.second;
-			if (sector)
+void readDiskCommand(const std::vector<std::unique_ptr<Track>>& tracks,
+    const BitmapDecoder& bitmapDecoder, const RecordParser& recordParser,
+    const std::string& outputFilename)
+{
+	bool failures = false;
+	SectorSet allSectors;
+	if (streamImage)
+	{
+		Geometry geometry = {};
+		for (const auto& track : tracks)
+		{
+			geometry.tracks = std::max(geometry.tracks, (int)track->track + 1);
+			geometry.heads = std::max(geometry.heads, (int)track->side + 1);
+		}
+		imageWriter.reset(new ImageWriter(outputFilename, geometry));
+	}
+
+	if (decodeThreads > 0)
+		readDiskPipelined(bitmapDecoder, recordParser, tracks, allSectors, failures);
+	else
+		readDiskSerially(bitmapDecoder, recordParser, tracks, allSectors, failures);
+
+	if (imageWriter)
+	{
+		imageWriter->close();
+		showSectorMap(allSectors, imageWriter->geometry());
+		imageWriter.reset();
+	}
+	else
+	{
+		Geometry geometry = guessGeometry(allSectors);
+		writeSectorsToFile(allSectors, geometry, outputFilename);
+	}
+	if (failures)
+		std::cerr << "Warning: some sectors could not be decoded." << std::endl;
+}
+
+/*
+ * Each candidate has a worker thread of its own, and every track read is
+ * queued for all of them; they share the fluxmap, which none of them
+ * changes. A track's summary is printed once every candidate has decoded it. Sectors whose numbers fall outside
+ * the image (which happens when the sector ID base is wrong) aren't counted,
+ * and ties go to the interpretation leaving the fewest holes in the image.
+ * Each candidate's decode log is kept, and only the winner's is shown.
+ */
+unsigned readDiskTrialCommand(const std::vector<std::unique_ptr<Track>>& tracks,
+    const std::vector<ReadCandidate>& candidates, const std::string& outputFilename)
+{
+	if (streamImage)
+		Error() << "--stream-image can't be used when trial decoding, as the image's shape isn't known until the end";
+
+	struct Trial
+	{
+		SectorSet sectors;
+		bool failures = false;
+		unsigned good = 0;
+		unsigned missing = 0;
+		std::string log;
+	};
+	std::vector<Trial> trials(candidates.size());
+
+	struct Job
+	{
+		unsigned index;
+		std::shared_ptr<const Fluxmap> fluxmap;
+	};
+
+	std::vector<std::vector<std::string>> results(tracks.size(),
+		std::vector<std::string>(candidates.size()));
+	std::vector<unsigned> decoded(tracks.size());
+	std::mutex consoleMutex;
+	WorkerError error;
+
+	std::vector<std::unique_ptr<BoundedQueue<Job>>> queues;
+	std::vector<std::thread> workers;
+	for (unsigned i=0; i<candidates.size(); i++)
+	{
+		queues.push_back(std::unique_ptr<BoundedQueue<Job>>(
+			new BoundedQueue<Job>(TRIAL_QUEUE_LENGTH)));
+		workers.push_back(std::thread(
+			[&, i]()
 			{
-				if (!printedTrack)
+				const auto& candidate = candidates[i];
+				Job job;
+
+				/* After a failure, keep draining the queue so the reader never blocks. */
+				while (queues[i]->pop(job))
 				{
-					std::cout << fmt::format("logical track {}.{}; ", sector->track, sector->side);
-					printedTrack = true;
+					if (error.failed())
+						continue;
+					try
+					{
+						const auto& track = tracks[job.index];
+						std::stringstream out;
+						TrackSectors readSectors;
+						decodeTrackAttempt(candidate.bitmapDecoder, candidate.recordParser,
+							*job.fluxmap, readSectors, 0, trials[i].failures, "", out);
+						unsigned good = storeTrackSectors(candidate.recordParser,
+							readSectors, trials[i].sectors, out);
+						trials[i].log += fmt::format("{0:>3}.{1}: ", track->track, track->side)
+							+ out.str();
+
+						std::lock_guard<std::mutex> lock(consoleMutex);
+						auto& trackResults = results[job.index];
+						trackResults[i] = fmt::format("{} sectors, {} good", readSectors.size(), good);
+						if (++decoded[job.index] == candidates.size())
+							for (unsigned j=0; j<candidates.size(); j++)
+								std::cout << "       " << candidates[j].name << ": "
+									<< trackResults[j] << std::endl;
+					}
+					catch (...)
+					{
+						error.capture();
+					}
 				}
+			}
+		));
+	}
 
-				size += sector->data.size();
-				allSectors.get(sector->track, sector->side, sector->sector) = std::move(sector);
+	try
+	{
+		for (unsigned index=0; (index < tracks.size()) && !error.failed(); index++)
+		{
+			std::shared_ptr<const Fluxmap> fluxmap;
+			{
+				std::lock_guard<std::mutex> lock(consoleMutex);
+				fluxmap = tracks[index]->read();
 			}
-        }
-        std::cout << size << " bytes decoded." << std::endl;
-    }
+			for (auto& queue : queues)
+				queue->push({ index, fluxmap });
+		}
+	}
+	catch (...)
+	{
+		error.capture();
+	}
 
-	Geometry geometry = guessGeometry(allSectors);
-    writeSectorsToFile(allSectors, geometry, outputFilename);
-	if (failures)
+	for (auto& queue : queues)
+		queue->close();
+	for (auto& worker : workers)
+		worker.join();
+	error.rethrow();
+
+	unsigned best = 0;
+	for (unsigned i=0; i<candidates.size(); i++)
+	{
+		Trial& trial = trials[i];
+		const SectorSet& sectors = trial.sectors;
+		Geometry geometry = guessGeometry(sectors);
+		for (int track = 0; track < geometry.tracks; track++)
+			for (int head = 0; head < geometry.heads; head++)
+				for (int sectorId = 0; sectorId < geometry.sectors; sectorId++)
+				{
+					const Sector* sector = sectors.get(track, head, sectorId);
+					if (!sector)
+						trial.missing++;
+					else if (sector->status == Sector::OK)
+						trial.good++;
+				}
+
+		std::cout << fmt::format("{}: {} good sectors, {} missing",
+				candidates[i].name, trial.good, trial.missing)
+			<< std::endl;
+		if ((trial.good > trials[best].good)
+				|| ((trial.good == trials[best].good) && (trial.missing < trials[best].missing)))
+			best = i;
+	}
+	std::cout << "Using " << candidates[best].name << std::endl
+		<< trials[best].log;
+
+	Geometry geometry = guessGeometry(trials[best].sectors);
+    writeSectorsToFile(trials[best].sectors, geometry, outputFilename);
+	if (trials[best].failures)
 		std::cerr << "Warning: some sectors could not be decoded." << std::endl;
+	return best;
 }
@@ -34,5 +34,24 @@ extern std::vector<std::unique_ptr<Track>> readTracks();
 extern void readDiskCommand(
     const BitmapDecoder& bitmapDecoder, const RecordParser& recordParser,
     const std::string& outputFilename);
+extern void readDiskCommand(const std::vector<std::unique_ptr<Track>>& tracks,
+    const BitmapDecoder& bitmapDecoder, const RecordParser& recordParser,
+    const std::string& outputFilename);
+
+/* One way of interpreting a disk, for readDiskTrialCommand(). */
+struct ReadCandidate
+{
+    std::string name;
+    const BitmapDecoder& bitmapDecoder;
+    const RecordParser& recordParser;
+};
+
+/*
+ * Reads each track once and decodes it every way in candidates at once,
+ * then writes out whichever interpretation found the most good sectors and
+ * returns its index.
+ */
+extern unsigned readDiskTrialCommand(const std::vector<std::unique_ptr<Track>>& tracks,
+    const std::vector<ReadCandidate>& candidates, const std::string& outputFilename);
 
 #endif
@@ -0,0 +1,73 @@
+#include "globals.h"
+#include "record.h"
+#include <algorithm>
+#include <mutex>
+
+/* Big enough for a whole track of most formats. */
+#define ARENA_BLOCK_SIZE 65536
+
+/* Any more idle arenas than this are freed instead. */
+#define MAX_POOLED_ARENAS 16
+
+static std::mutex poolMutex;
+static std::vector<RecordArena*> pool;
+
+std::shared_ptr<RecordArena> RecordArena::create()
+{
+	RecordArena* arena = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(poolMutex);
+		if (!pool.empty())
+		{
+			arena = pool.back();
+			pool.pop_back();
+		}
+	}
+
+	if (!arena)
+		arena = new RecordArena();
+	return std::shared_ptr<RecordArena>(arena, recycle);
+}
+
+void RecordArena::recycle(RecordArena* arena)
+{
+	arena->_block = 0;
+	arena->_used = 0;
+
+	std::lock_guard<std::mutex> lock(poolMutex);
+	if (pool.size() < MAX_POOLED_ARENAS)
+		pool.push_back(arena);
+	else
+		delete arena;
+}
+
+uint8_t* RecordArena::allocate(size_t size)
+{
+	while (_block < _blocks.size())
+	{
+		Block& block = _blocks[_block];
+		if ((_used + size) <= block.size)
+		{
+			uint8_t* p = block.bytes.get() + _used;
+			_used += size;
+			return p;
+		}
+
+		_block++;
+		_used = 0;
+	}
+
+	/* Oversized records get a block of their own. */
+	size_t blockSize = std::max<size_t>(size, ARENA_BLOCK_SIZE);
+	_blocks.push_back({ std::unique_ptr<uint8_t[]>(new uint8_t[blockSize]), blockSize });
+	_used = size;
+	return _blocks.back().bytes.get();
+}
+
+ByteSpan RecordArena::copy(const std::vector<uint8_t>& data)
+{
+	uint8_t* p = allocate(data.size());
+	if (!data.empty())
+		memcpy(p, data.data(), data.size());
+	return ByteSpan(p, data.size());
+}
@@ -1,15 +1,62 @@
 #ifndef RECORD_H
 #define RECORD_H
 
+/*
+ * A data bit which may have been decoded wrongly, as a pulse near it landed
+ * far from the clock grid; weakness runs up to 128, which is halfway between
+ * two cells. Bits are numbered from the top bit of the record's first byte.
+ */
+struct WeakBit
+{
+	unsigned bit;
+	unsigned weakness;
+};
+
+/*
+ * Holds the bytes of a track's worth of records (or sectors) in a few big
+ * blocks, so that decoding one doesn't mean allocating memory for it. Each
+ * record or sector keeps its arena alive; once the last one has gone, the
+ * arena is emptied and put back in a pool, to be used again for the next
+ * track (or the next attempt at this one).
+ */
+class RecordArena
+{
+public:
+	static std::shared_ptr<RecordArena> create();
+
+	/* The bytes stay put until the arena is recycled. */
+	uint8_t* allocate(size_t size);
+	ByteSpan copy(const std::vector<uint8_t>& data);
+
+private:
+	RecordArena() {}
+	static void recycle(RecordArena* arena);
+
+	struct Block
+	{
+		std::unique_ptr<uint8_t[]> bytes;
+		size_t size;
+	};
+
+	std::vector<Block> _blocks;
+	size_t _block = 0;
+	size_t _used = 0;
+};
+
 class Record
 {
 public:
-	Record(nanoseconds_t position, const std::vector<uint8_t>& data):
-		position(position), data(data)
+	Record(nanoseconds_t position, const ByteSpan& data,
+			const std::shared_ptr<RecordArena>& arena):
+		position(position), data(data), _arena(arena)
 	{}
 
 	size_t position; // in bits
-	std::vector<uint8_t> data;
+	ByteSpan data; // in the arena
+	std::vector<WeakBit> weakBits;
+
+private:
+	std::shared_ptr<RecordArena> _arena;
 };
 
 typedef std::vector<std::unique_ptr<Record>> RecordVector;
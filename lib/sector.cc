@@ -1,5 +1,6 @@
 #include "globals.h"
 #include "sector.h"
+#include "record.h"
 #include "fmt/format.h"
 
 const std::string Sector::statusToString(Status status)
@@ -12,3 +13,23 @@ const std::string Sector::statusToString(Status status)
         default:                   return fmt::format("unknown error {}", status);
     }
 }
+
+std::unique_ptr<Sector> Sector::copy() const
+{
+    Sector* sector;
+    if (_arena && raw.empty())
+        sector = new Sector(status, track, side, this->sector, data, _arena);
+    else if (_arena)
+        sector = new Sector(status, track, side, this->sector, raw, _arena,
+            dataOffset, data.size());
+    else if (raw.empty())
+        sector = new Sector(status, track, side, this->sector, data.vector());
+    else
+        sector = new Sector(status, track, side, this->sector, raw.vector(),
+            dataOffset, data.size());
+
+    sector->copies = copies;
+    sector->confidence = confidence;
+    sector->repairedBits = repairedBits;
+    return std::unique_ptr<Sector>(sector);
+}
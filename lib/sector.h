@@ -1,6 +1,8 @@
 #ifndef SECTOR_H
 #define SECTOR_H
 
+class RecordArena;
+
 /* 
  * Note that sectors here used zero-based numbering throughout (to make the
  * maths easier); traditionally floppy disk use 0-based track numbering and
@@ -23,14 +25,92 @@ public:
         track(track),
         side(side),
         sector(sector),
-        data(data)
+        _bytes(data),
+        data(_bytes),
+        dataOffset(0)
     {}
 
+    /* Takes over the raw bytes; the data is dataLength of them, at dataOffset. */
+    Sector(int status, int track, int side, int sector, std::vector<uint8_t>&& raw,
+            unsigned dataOffset, unsigned dataLength):
+		status(status),
+        track(track),
+        side(side),
+        sector(sector),
+        _bytes(std::move(raw)),
+        data(_bytes.data() + dataOffset, dataLength),
+        raw(_bytes),
+        dataOffset(dataOffset)
+    {
+        assert((dataOffset + dataLength) <= _bytes.size());
+    }
+
+    /*
+     * Leaves the raw bytes where they are, in an arena shared with the rest
+     * of the track, which the sector keeps alive.
+     */
+    Sector(int status, int track, int side, int sector, const ByteSpan& raw,
+            const std::shared_ptr<RecordArena>& arena,
+            unsigned dataOffset, unsigned dataLength):
+		status(status),
+        track(track),
+        side(side),
+        sector(sector),
+        _arena(arena),
+        data(raw.data() + dataOffset, dataLength),
+        raw(raw),
+        dataOffset(dataOffset)
+    {
+        assert((dataOffset + dataLength) <= raw.size());
+    }
+
+    /* The same, for a sector which has only data. */
+    Sector(int status, int track, int side, int sector, const ByteSpan& data,
+            const std::shared_ptr<RecordArena>& arena):
+		status(status),
+        track(track),
+        side(side),
+        sector(sector),
+        _arena(arena),
+        data(data),
+        dataOffset(0)
+    {}
+
+    /* data and raw may point into the sector itself; use copy() instead. */
+    Sector(const Sector&) = delete;
+
+    /* Returns a copy of the sector, which shares its bytes if they're in an arena. */
+    std::unique_ptr<Sector> copy() const;
+
 	const int status;
     const int track;
     const int side;
     const int sector;
-    const std::vector<uint8_t> data;
+
+private:
+    const std::vector<uint8_t> _bytes;
+    const std::shared_ptr<RecordArena> _arena;
+
+public:
+    const ByteSpan data;
+
+    /*
+     * The bytes covered by the sector's checksum, as read, followed by the
+     * checksum itself; data is the part of them starting at dataOffset.
+     * Empty if the parser doesn't support voting.
+     */
+    const ByteSpan raw;
+    const unsigned dataOffset;
+
+    /*
+     * When a sector has been voted on, how many copies went into it, and
+     * the smallest fraction of them which agreed on any one byte.
+     */
+    unsigned copies = 1;
+    double confidence = 1.0;
+
+    /* How many bits were flipped to make the checksum match, if any. */
+    unsigned repairedBits = 0;
 };
 
 #endif
@@ -5,17 +5,35 @@
 
 std::unique_ptr<Sector>& SectorSet::get(int track, int head, int sector)
 {
-        key_t key(track, head, sector);
-	return _data[key];
+	if (!isDense(track, head, sector))
+		return _sparse[keyof(track, head, sector)];
+
+	if ((size_t)track >= _tracks.size())
+		_tracks.resize(track + 1);
+	auto& slots = _tracks[track];
+	size_t index = sector*DENSE_HEADS + head;
+	if (index >= slots.size())
+		slots.resize((sector + 1) * DENSE_HEADS);
+	return slots[index];
 }
 
 Sector* SectorSet::get(int track, int head, int sector) const
 {
-        key_t key(track, head, sector);
-	auto i = _data.find(key);
-	if (i == _data.end())
+	if (!isDense(track, head, sector))
+	{
+		auto i = _sparse.find(keyof(track, head, sector));
+		if (i == _sparse.end())
+			return NULL;
+		return i->second.get();
+	}
+
+	if ((size_t)track >= _tracks.size())
+		return NULL;
+	const auto& slots = _tracks[track];
+	size_t index = sector*DENSE_HEADS + head;
+	if (index >= slots.size())
 		return NULL;
-	return i->second.get();
+	return slots[index].get();
 }
 
 void SectorSet::calculateSize(int& numTracks, int& numHeads, int& numSectors,
@@ -23,9 +41,8 @@ void SectorSet::calculateSize(int& numTracks, int& numHeads, int& numSectors,
 {
 	numTracks = numHeads = numSectors = sectorSize = 0;
 
-	for (auto& i : _data)
+	auto add = [&](const std::unique_ptr<Sector>& sector)
 	{
-		auto& sector = i.second;
 		if (sector)
 		{
 			numTracks = std::max(numTracks, sector->track+1);
@@ -33,7 +50,11 @@ void SectorSet::calculateSize(int& numTracks, int& numHeads, int& numSectors,
 			numSectors = std::max(numSectors, sector->sector+1);
 			sectorSize = std::max(sectorSize, (int)sector->data.size());
 		}
-	}
-}
-
+	};
 
+	for (const auto& slots : _tracks)
+		for (const auto& sector : slots)
+			add(sector);
+	for (const auto& i : _sparse)
+		add(i.second);
+}
@@ -3,6 +3,18 @@
 
 class Sector;
 
+/*
+ * Sectors indexed by track, head and sector number. Ordinary disks fit in a
+ * dense table, with one block of slots per track; anything outside it (like
+ * negative sector numbers from a wrong sector ID base) goes in a map.
+ *
+ * The sectors' bytes aren't kept here, but by the sectors themselves; those
+ * read from a disk share an arena with the rest of their track, and those
+ * read from an image share one with the rest of the image.
+ *
+ * The reference returned by the non-const get() is only good until the next
+ * call to it, as adding a sector can move its track's slots.
+ */
 class SectorSet
 {
 private:
@@ -21,8 +33,23 @@ public:
 		int& sectorSize) const;
 
 private:
-	std::map<const key_t, std::unique_ptr<Sector>> _data;
+	static bool isDense(int track, int head, int sector)
+	{
+		return (track >= 0) && (track < DENSE_TRACKS)
+			&& (head >= 0) && (head < DENSE_HEADS)
+			&& (sector >= 0) && (sector < DENSE_SECTORS);
+	}
+
+	enum
+	{
+		DENSE_TRACKS = 256,
+		DENSE_HEADS = 2,
+		DENSE_SECTORS = 256
+	};
+
+	/* Each track's slots go sector by sector, with the heads interleaved. */
+	std::vector<std::vector<std::unique_ptr<Sector>>> _tracks;
+	std::map<const key_t, std::unique_ptr<Sector>> _sparse;
 };
 
 #endif
-
@@ -0,0 +1,496 @@
+#include "globals.h"
+#include "usb.h"
+#include "protocol.h"
+#include "fluxmap.h"
+#include "flags.h"
+#include "sql.h"
+#include "crc.h"
+#include <string.h>
+#include <endian.h>
+#include <chrono>
+#include <deque>
+#include <thread>
+
+/*
+ * A FluxEngine which exists only in software. It accepts the same command
+ * frames as the firmware and replies to them the same way, and models the
+ * things which make real hardware slow: motor spin-up, stepping and settling,
+ * waiting for the index hole, and the disk going round. Flux comes from a
+ * .flux file or is made up on the spot (an IBM 1440kB format, so fe-readibm
+ * can decode it); anything written is kept in memory and read back later.
+ *
+ * Timings follow the firmware in FluxEngine.cydsn/main.c.
+ */
+
+static DoubleFlag simulatedTimeScale(
+    { "--simulated-time-scale" },
+    "How fast the simulated FluxEngine's clock runs relative to real time; 0 doesn't wait at all.",
+    1.0);
+
+static IntFlag simulatedRpm(
+    { "--simulated-rpm" },
+    "Rotational speed of the simulated drive.",
+    300);
+
+#define MOTOR_SPINUP_TIME_MS 1000
+#define MOTOR_ON_TIME_MS     5000
+#define STEP_TIME_MS         7
+#define STEP_SETTLING_TIME_MS 40
+
+/* Where the simulated head starts out, before it's been homed. */
+#define INITIAL_TRACK 40
+
+/* The synthetic disk: 80 tracks of 18 512-byte sectors at 500kbps. */
+#define SYNTHETIC_TRACKS  80
+#define SYNTHETIC_SECTORS 18
+#define SYNTHETIC_SECTOR_SIZE 512
+#define SYNTHETIC_TRACK_BYTES 12500
+#define SYNTHETIC_CELL_TICKS (1 * TICKS_PER_US)
+
+#define STREAM_CHUNK_SIZE (16*1024)
+
+typedef uint64_t ticks_t;
+
+/* Builds a flux track out of MFM-encoded bytes. */
+class MfmTrackBuilder
+{
+public:
+    MfmTrackBuilder(Fluxmap& fluxmap): _fluxmap(fluxmap) {}
+
+    void write(uint8_t byte, int count = 1)
+    {
+        while (count--)
+            writeByte(byte, 0x00);
+    }
+
+    void write(const std::vector<uint8_t>& bytes)
+    {
+        for (uint8_t byte : bytes)
+            writeByte(byte, 0x00);
+    }
+
+    /* 0xA1 and 0xC2 sync marks have a clock bit missing. */
+    void writeA1() { writeByte(0xa1, 0x04); }
+    void writeC2() { writeByte(0xc2, 0x08); }
+
+    size_t bytes() const { return _bytes; }
+
+private:
+    void writeByte(uint8_t byte, uint8_t missingClocks)
+    {
+        for (int i=7; i>=0; i--)
+        {
+            bool data = (byte >> i) & 1;
+            bool clock = !_lastData && !data && !((missingClocks >> i) & 1);
+            writeCell(clock);
+            writeCell(data);
+            _lastData = data;
+        }
+        _bytes++;
+    }
+
+    void writeCell(bool pulse)
+    {
+        _ticks += SYNTHETIC_CELL_TICKS;
+        if (pulse)
+        {
+            _fluxmap.appendInterval(_ticks);
+            _ticks = 0;
+        }
+    }
+
+    Fluxmap& _fluxmap;
+    bool _lastData = false;
+    unsigned _ticks = 0;
+    size_t _bytes = 0;
+};
+
+static std::unique_ptr<Fluxmap> syntheticTrack(int track, int side)
+{
+    std::unique_ptr<Fluxmap> fluxmap(new Fluxmap);
+    if (track >= SYNTHETIC_TRACKS)
+        return fluxmap;
+
+    MfmTrackBuilder builder(*fluxmap);
+    builder.write(0x4e, 80);
+    builder.write(0x00, 12);
+    builder.writeC2(); builder.writeC2(); builder.writeC2();
+    builder.write(0xfc);
+    builder.write(0x4e, 50);
+
+    for (int sector=0; sector<SYNTHETIC_SECTORS; sector++)
+    {
+        auto writeRecord = [&](std::vector<uint8_t> record)
+        {
+            record.insert(record.begin(), { 0xa1, 0xa1, 0xa1 });
+            uint16_t crc = crc16(CCITT_POLY, &record[0], &record[record.size()]);
+            record.push_back(crc >> 8);
+            record.push_back(crc);
+
+            builder.write(0x00, 12);
+            builder.writeA1(); builder.writeA1(); builder.writeA1();
+            builder.write(std::vector<uint8_t>(record.begin() + 3, record.end()));
+        };
+
+        writeRecord({ 0xfe, (uint8_t)track, (uint8_t)side, (uint8_t)(sector+1), 2 });
+        builder.write(0x4e, 22);
+
+        std::vector<uint8_t> data(1 + SYNTHETIC_SECTOR_SIZE);
+        data[0] = 0xfb;
+        for (int i=0; i<SYNTHETIC_SECTOR_SIZE; i++)
+            data[1+i] = track*7 + side*3 + sector + i;
+        writeRecord(data);
+        builder.write(0x4e, 84);
+    }
+
+    if (builder.bytes() < SYNTHETIC_TRACK_BYTES)
+        builder.write(0x4e, SYNTHETIC_TRACK_BYTES - builder.bytes());
+    return fluxmap;
+}
+
+class SimulatedFluxEngine : public FluxEngineDevice
+{
+public:
+    SimulatedFluxEngine(const std::string& source):
+        _epoch(std::chrono::steady_clock::now()),
+        _period((ticks_t)TICK_FREQUENCY * 60 / simulatedRpm)
+    {
+        if (source != "synthetic")
+            _db.reset(new SqlFluxStore(source, SQLITE_OPEN_READONLY));
+    }
+
+    void sendCommand(const void* frame, int len)
+    {
+        const any_frame* f = (const any_frame*) frame;
+        if ((len < (int)sizeof(any_frame)) || (f->f.size != len))
+        {
+            sendError(F_ERROR_BAD_COMMAND);
+            return;
+        }
+
+        catchUp();
+        switch (f->f.type)
+        {
+            case F_FRAME_GET_VERSION_CMD:
+            {
+                version_frame r = { { F_FRAME_GET_VERSION_REPLY, sizeof(r) } };
+                r.version = FLUXENGINE_VERSION;
+                sendReply(&r, sizeof(r));
+                break;
+            }
+
+            case F_FRAME_SEEK_CMD:
+                seekTo(((const seek_frame*) frame)->track);
+                sendReply(F_FRAME_SEEK_REPLY);
+                break;
+
+            case F_FRAME_RECALIBRATE_CMD:
+                _homed = false;
+                seekTo(0);
+                sendReply(F_FRAME_RECALIBRATE_REPLY);
+                break;
+
+            case F_FRAME_MEASURE_SPEED_CMD:
+            {
+                startMotor();
+                waitForIndex();
+                advance(_period);
+
+                speed_frame r = { { F_FRAME_MEASURE_SPEED_REPLY, sizeof(r) } };
+                r.period_ms = _period / TICKS_PER_MS;
+                sendReply(&r, sizeof(r));
+                break;
+            }
+
+            case F_FRAME_BULK_TEST_CMD:
+                _pending = F_FRAME_BULK_TEST_CMD;
+                break;
+
+            case F_FRAME_READ_CMD:
+            {
+                const read_frame* rf = (const read_frame*) frame;
+                _side = rf->side & SIDE_SIDEB;
+                _revolutions = rf->revolutions;
+                seekTo(_track);
+                _pending = F_FRAME_READ_CMD;
+                break;
+            }
+
+            case F_FRAME_WRITE_CMD:
+            {
+                const write_frame* wf = (const write_frame*) frame;
+                if (le32toh(wf->bytes_to_write) % FRAME_SIZE)
+                {
+                    sendError(F_ERROR_INVALID_VALUE);
+                    break;
+                }
+                _side = wf->side & SIDE_SIDEB;
+                _bytesToWrite = le32toh(wf->bytes_to_write);
+                seekTo(_track);
+                _pending = F_FRAME_WRITE_CMD;
+                break;
+            }
+
+            case F_FRAME_ERASE_CMD:
+                _side = ((const erase_frame*) frame)->side & SIDE_SIDEB;
+                seekTo(_track);
+                waitForIndex();
+                advance(_period);
+                _disk[key()].reset(new Fluxmap);
+                sendReply(F_FRAME_ERASE_REPLY);
+                break;
+
+            case F_FRAME_SET_DRIVE_CMD:
+                _drive = ((const set_drive_frame*) frame)->drive;
+                sendReply(F_FRAME_SET_DRIVE_REPLY);
+                break;
+
+            default:
+                sendError(F_ERROR_BAD_COMMAND);
+                break;
+        }
+    }
+
+    void receiveReply(void* frame, int len)
+    {
+        if (_replies.empty())
+            Error() << "failed to receive command reply: simulated device has nothing to say";
+
+        const std::vector<uint8_t>& reply = _replies.front();
+        if ((int)reply.size() > len)
+            Error() << "failed to receive command reply: overflow";
+        memcpy(frame, &reply[0], reply.size());
+        _replies.pop_front();
+    }
+
+    /* Only the bulk test sends a fixed amount of data. */
+    void receiveData(uint8_t* buffer, int len)
+    {
+        if (_pending != F_FRAME_BULK_TEST_CMD)
+            Error() << "data transfer failed: simulated device isn't sending";
+        _pending = 0;
+
+        /* These must match usbTestBulkTransport(). */
+        const int XSIZE = 64;
+        const int YSIZE = 256;
+        const int ZSIZE = 64;
+        for (int x=0; x<XSIZE; x++)
+            for (int y=0; y<YSIZE; y++)
+                for (int z=0; z<ZSIZE; z++)
+                {
+                    int offset = x*XSIZE*YSIZE + y*ZSIZE + z;
+                    if (offset < len)
+                        buffer[offset] = x+y+z;
+                }
+
+        sendReply(F_FRAME_BULK_TEST_REPLY);
+    }
+
+    /*
+     * Sends the same revolution of flux once per revolution asked for,
+     * starting at the index hole, and paced to the speed of the disk.
+     */
+    void receiveStream(const UsbReadCallback& callback)
+    {
+        if (_pending != F_FRAME_READ_CMD)
+            Error() << "data transfer failed: simulated device isn't sending";
+        _pending = 0;
+
+        /* The hardware sends flux in the byte form. */
+        std::vector<uint8_t> bytes = revolution().toBytes();
+        int size = bytes.size();
+        waitForIndex();
+        ticks_t end = _now + _period*_revolutions;
+        for (int revolution=0; revolution<_revolutions; revolution++)
+        {
+            for (int i=0; i<size; i += STREAM_CHUNK_SIZE)
+            {
+                int len = std::min(size - i, STREAM_CHUNK_SIZE);
+                ticks_t ticks = 0;
+                for (int j=0; j<len; j++)
+                    ticks += bytes[i+j] ? bytes[i+j] : 0x100;
+
+                advance(ticks);
+                callback(&bytes[i], len);
+            }
+        }
+        if (_now < end)
+            advance(end - _now);
+
+        sendReply(F_FRAME_READ_REPLY);
+    }
+
+    /* The write starts at the index hole and stops at the next one. */
+    void sendData(const uint8_t* buffer, int len)
+    {
+        if (_pending != F_FRAME_WRITE_CMD)
+            Error() << "data transfer failed: simulated device isn't listening";
+        _pending = 0;
+        if (len != (int)_bytesToWrite)
+            Error() << "data transfer failed: simulated device expected "
+                    << _bytesToWrite << " bytes but got " << len;
+
+        waitForIndex();
+
+        /* The host sends timestamps; turn them back into intervals. */
+        std::unique_ptr<Fluxmap> fluxmap(new Fluxmap);
+        uint8_t clock = 0;
+        ticks_t ticks = 0;
+        std::vector<uint8_t> bytes;
+        bytes.reserve(len);
+        for (int i=0; i<len; i++)
+        {
+            uint8_t interval = buffer[i] - clock;
+            clock = buffer[i];
+            ticks += interval ? interval : 0x100;
+            if (ticks > _period)
+                break;
+            bytes.push_back(interval);
+        }
+        fluxmap->appendBytes(bytes);
+        _disk[key()] = std::move(fluxmap);
+        advance(_period);
+
+        sendReply(F_FRAME_WRITE_REPLY);
+    }
+
+    ticks_t now() const { return _now; }
+
+private:
+    typedef std::tuple<int, int, int> Key;
+
+    Key key() const { return std::make_tuple(_drive, _track, _side); }
+
+    /* One revolution's worth of whatever's on the disk under the head. */
+    const Fluxmap& revolution()
+    {
+        auto& fluxmap = _disk[key()];
+        if (!fluxmap)
+        {
+            std::unique_ptr<Fluxmap> source;
+            if (_db)
+                source = _db->readFlux(_track, _side);
+            else
+                source = syntheticTrack(_track, _side);
+
+            fluxmap.reset(new Fluxmap);
+            ticks_t ticks = 0;
+            int length = 0;
+            for (; length<source->size(); length++)
+            {
+                uint16_t interval = (*source)[length];
+                ticks += interval ? interval : 0xffff;
+                if (ticks > _period)
+                    break;
+            }
+            fluxmap->appendIntervals(source->ptr(), length);
+        }
+        return *fluxmap;
+    }
+
+    void sendReply(const void* frame, int len)
+    {
+        const uint8_t* p = (const uint8_t*) frame;
+        _replies.push_back(std::vector<uint8_t>(p, p+len));
+    }
+
+    void sendReply(int type)
+    {
+        any_frame r = { { (uint8_t)type, sizeof(r) } };
+        sendReply(&r, sizeof(r));
+    }
+
+    void sendError(int error)
+    {
+        error_frame r = { { F_FRAME_ERROR, sizeof(r) } };
+        r.error = error;
+        sendReply(&r, sizeof(r));
+    }
+
+    /* The disk keeps turning while the host is busy. */
+    void catchUp()
+    {
+        if (simulatedTimeScale <= 0.0)
+            return;
+        double elapsed = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - _epoch).count();
+        ticks_t now = elapsed * TICK_FREQUENCY / simulatedTimeScale;
+        if (now > _now)
+            _now = now;
+    }
+
+    void advance(ticks_t ticks)
+    {
+        _now += ticks;
+        if (simulatedTimeScale > 0.0)
+            std::this_thread::sleep_until(_epoch +
+                std::chrono::duration<double>(_now * simulatedTimeScale / TICK_FREQUENCY));
+    }
+
+    void advanceMs(int ms)
+    {
+        advance((ticks_t)ms * TICKS_PER_MS);
+    }
+
+    void waitForIndex()
+    {
+        advance(_period - (_now % _period));
+    }
+
+    void startMotor()
+    {
+        if (!_motorOn || ((_now - _motorOnTime) > ((ticks_t)MOTOR_ON_TIME_MS * TICKS_PER_MS)))
+        {
+            advanceMs(MOTOR_SPINUP_TIME_MS);
+            _homed = false;
+        }
+        _motorOn = true;
+        _motorOnTime = _now;
+    }
+
+    void seekTo(int track)
+    {
+        startMotor();
+        if (!_homed)
+        {
+            /* Step out to track 0, then once more to -1. */
+            advanceMs(STEP_TIME_MS * (_track + 1));
+            _homed = true;
+            _track = 0;
+            advanceMs(1);
+        }
+
+        advanceMs(STEP_TIME_MS * std::abs(track - _track));
+        _track = track;
+        advanceMs(STEP_SETTLING_TIME_MS);
+    }
+
+    std::unique_ptr<SqlFluxStore> _db;
+    std::chrono::steady_clock::time_point _epoch;
+    ticks_t _period;
+    ticks_t _now = 0;
+    ticks_t _motorOnTime = 0;
+    bool _motorOn = false;
+    bool _homed = false;
+    int _drive = 0;
+    int _track = INITIAL_TRACK;
+    int _side = 0;
+    int _revolutions = 0;
+    unsigned _bytesToWrite = 0;
+    int _pending = 0;
+    std::deque<std::vector<uint8_t>> _replies;
+    std::map<Key, std::unique_ptr<Fluxmap>> _disk;
+};
+
+std::unique_ptr<FluxEngineDevice> createSimulatedFluxEngine(const std::string& source)
+{
+    return std::unique_ptr<FluxEngineDevice>(new SimulatedFluxEngine(source));
+}
+
+uint64_t simulatedFluxEngineTime(const FluxEngineDevice& device)
+{
+    auto simulated = dynamic_cast<const SimulatedFluxEngine*>(&device);
+    if (!simulated)
+        Error() << "not a simulated FluxEngine";
+    return simulated->now();
+}
@@ -1,6 +1,20 @@
 #include "globals.h"
 #include "sql.h"
 #include "fluxmap.h"
+#include "flags.h"
+#include "huffman.h"
+#include <string.h>
+
+static SettableFlag compressFlux(
+    { "--compress-flux" },
+    "Compress flux data written to .flux files (older versions can't read these).");
+
+/* How the flux in each row of rawdata is stored. */
+enum
+{
+    FLUX_UNCOMPRESSED = 0,
+    FLUX_HUFFMAN = 1,
+};
 
 void sqlCheck(sqlite3* db, int i)
 {
@@ -31,70 +45,223 @@ void sqlStmt(sqlite3* db, const char* sql)
         Error() << "database error: %s" << errmsg;
 }
 
-void sql_bind_blob(sqlite3* db, sqlite3_stmt* stmt, const char* name,
-    const void* ptr, size_t bytes)
+static int sql_parameter(sqlite3* db, sqlite3_stmt* stmt, const char* name)
 {
-    sqlCheck(db, sqlite3_bind_blob(stmt,
-        sqlite3_bind_parameter_index(stmt, name),
-        ptr, bytes, SQLITE_TRANSIENT));
+    int i = sqlite3_bind_parameter_index(stmt, name);
+    if (i == 0)
+        Error() << "database error: no parameter " << name;
+    return i;
 }
 
-void sql_bind_int(sqlite3* db, sqlite3_stmt* stmt, const char* name, int value)
+/* The blob must stay put until the statement has been stepped. */
+static void sql_bind_blob(sqlite3* db, sqlite3_stmt* stmt, const char* name,
+    const void* ptr, size_t bytes)
 {
-    sqlCheck(db, sqlite3_bind_int(stmt,
-        sqlite3_bind_parameter_index(stmt, name),
-        value));
+    sqlCheck(db, sqlite3_bind_blob(stmt, sql_parameter(db, stmt, name),
+        ptr, bytes, SQLITE_STATIC));
 }
 
-void sqlPrepareFlux(sqlite3* db)
+static void sql_bind_int(sqlite3* db, sqlite3_stmt* stmt, const char* name, int value)
 {
-    sqlStmt(db, "PRAGMA synchronous = OFF;");
-    sqlStmt(db, "CREATE TABLE IF NOT EXISTS rawdata ("
-                 "  track INTEGER,"
-                 "  side INTEGER,"
-                 "  data BLOB,"
-                 "  PRIMARY KEY(track, side)"
-                 ");");
+    sqlCheck(db, sqlite3_bind_int(stmt, sql_parameter(db, stmt, name), value));
 }
 
-void sqlWriteFlux(sqlite3* db, int track, int side, const Fluxmap& fluxmap)
+static sqlite3_stmt* sql_prepare(sqlite3* db, const char* sql)
 {
     sqlite3_stmt* stmt;
-    sqlCheck(db, sqlite3_prepare_v2(db,
-        "INSERT OR REPLACE INTO rawdata (track, side, data) VALUES (:track, :side, :data)",
-        -1, &stmt, NULL));
-    sql_bind_int(db, stmt, ":track", track);
-    sql_bind_int(db, stmt, ":side", side);
-    sql_bind_blob(db, stmt, ":data", fluxmap.ptr(), fluxmap.bytes());
+    sqlCheck(db, sqlite3_prepare_v2(db, sql, -1, &stmt, NULL));
+    return stmt;
+}
 
-    if (sqlite3_step(stmt) != SQLITE_DONE)
-        Error() << "failed to write to database: " << sqlite3_errmsg(db);
+static bool sql_has_column(sqlite3* db, const char* table, const char* column)
+{
+    sqlite3_stmt* stmt = sql_prepare(db,
+        (std::string("PRAGMA table_info(") + table + ");").c_str());
+    bool found = false;
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        if (strcmp((const char*) sqlite3_column_text(stmt, 1), column) == 0)
+            found = true;
+    }
     sqlCheck(db, sqlite3_finalize(stmt));
+    return found;
 }
 
-std::unique_ptr<Fluxmap> sqlReadFlux(sqlite3* db, int track, int side)
+/* Commit this often so that an interrupted read doesn't lose everything. */
+#define WRITES_PER_TRANSACTION 32
+
+/*
+ * Files from older versions may not have the compression or index_marks
+ * columns; they're upgraded when opened for writing, and otherwise read as
+ * uncompressed flux with no index marks.
+ */
+SqlFluxStore::SqlFluxStore(const std::string& filename, int flags):
+    _db(sqlOpen(filename, flags))
 {
-    sqlite3_stmt* stmt;
-    sqlCheck(db, sqlite3_prepare_v2(db,
-        "SELECT data FROM rawdata WHERE track=:track AND side=:side",
-        -1, &stmt, NULL));
-    sql_bind_int(db, stmt, ":track", track);
-    sql_bind_int(db, stmt, ":side", side);
+    if (flags & SQLITE_OPEN_READWRITE)
+    {
+        sqlStmt(_db, "PRAGMA synchronous = OFF;");
+        sqlStmt(_db, "CREATE TABLE IF NOT EXISTS rawdata ("
+                     "  track INTEGER,"
+                     "  side INTEGER,"
+                     "  data BLOB,"
+                     "  compression INTEGER DEFAULT 0,"
+                     "  index_marks BLOB,"
+                     "  PRIMARY KEY(track, side)"
+                     ");");
+        if (!sql_has_column(_db, "rawdata", "compression"))
+            sqlStmt(_db, "ALTER TABLE rawdata ADD COLUMN compression INTEGER DEFAULT 0;");
+        if (!sql_has_column(_db, "rawdata", "index_marks"))
+            sqlStmt(_db, "ALTER TABLE rawdata ADD COLUMN index_marks BLOB;");
+        _writeStmt = sql_prepare(_db,
+            "INSERT OR REPLACE INTO rawdata (track, side, data, compression, index_marks)"
+            " VALUES (:track, :side, :data, :compression, :index_marks)");
+    }
+
+    std::string sql = "SELECT rowid, ";
+    sql += sql_has_column(_db, "rawdata", "compression") ? "compression, " : "0, ";
+    sql += sql_has_column(_db, "rawdata", "index_marks") ? "index_marks" : "NULL";
+    sql += " FROM rawdata WHERE track=:track AND side=:side";
+    _findStmt = sql_prepare(_db, sql.c_str());
+}
+
+SqlFluxStore::~SqlFluxStore()
+{
+    if (_blob)
+        sqlite3_blob_close(_blob);
+    sqlite3_finalize(_findStmt);
+    sqlite3_finalize(_writeStmt);
+    commit();
+    sqlClose(_db);
+}
+
+void SqlFluxStore::commit()
+{
+    if (_pendingWrites)
+        sqlStmt(_db, "COMMIT;");
+    _pendingWrites = 0;
+}
+
+void SqlFluxStore::writeFlux(int track, int side, const Fluxmap& fluxmap)
+{
+    if (!_writeStmt)
+        Error() << "failed to write to database: it's read only";
+
+    /* Writing expires any open blob handle. */
+    if (_blob)
+    {
+        sqlite3_blob_close(_blob);
+        _blob = NULL;
+    }
+
+    if (_pendingWrites == 0)
+        sqlStmt(_db, "BEGIN;");
+
+    sql_bind_int(_db, _writeStmt, ":track", track);
+    sql_bind_int(_db, _writeStmt, ":side", side);
+    /* Flux is stored in the byte form. */
+    std::vector<size_t> positions;
+    std::vector<uint8_t> bytes = fluxmap.toBytes(&positions);
+    std::vector<uint8_t> compressed;
+    if (compressFlux)
+    {
+        compressed = huffmanCompress(bytes.data(), bytes.size());
+        sql_bind_blob(_db, _writeStmt, ":data", &compressed[0], compressed.size());
+        sql_bind_int(_db, _writeStmt, ":compression", FLUX_HUFFMAN);
+    }
+    else
+    {
+        sql_bind_blob(_db, _writeStmt, ":data", bytes.data(), bytes.size());
+        sql_bind_int(_db, _writeStmt, ":compression", FLUX_UNCOMPRESSED);
+    }
+
+    /* Index marks are stored as little-endian 32-bit byte positions. */
+    std::vector<uint8_t> indexMarks;
+    for (uint32_t position : positions)
+    {
+        for (int j=0; j<4; j++)
+            indexMarks.push_back(position >> (j*8));
+    }
+    if (indexMarks.empty())
+        sqlCheck(_db, sqlite3_bind_null(_writeStmt,
+            sql_parameter(_db, _writeStmt, ":index_marks")));
+    else
+        sql_bind_blob(_db, _writeStmt, ":index_marks", &indexMarks[0], indexMarks.size());
+
+    if (sqlite3_step(_writeStmt) != SQLITE_DONE)
+        Error() << "failed to write to database: " << sqlite3_errmsg(_db);
+    sqlCheck(_db, sqlite3_reset(_writeStmt));
+    sqlCheck(_db, sqlite3_clear_bindings(_writeStmt));
 
+    if (++_pendingWrites == WRITES_PER_TRANSACTION)
+        commit();
+}
+
+/*
+ * Only the rowid goes through the statement; the flux itself is read with
+ * the incremental blob API.
+ */
+std::unique_ptr<Fluxmap> SqlFluxStore::readFlux(int track, int side)
+{
     auto fluxmap = std::unique_ptr<Fluxmap>(new Fluxmap());
 
-    int i = sqlite3_step(stmt);
-    if (i != SQLITE_DONE)
+    sql_bind_int(_db, _findStmt, ":track", track);
+    sql_bind_int(_db, _findStmt, ":side", side);
+    int i = sqlite3_step(_findStmt);
+    if ((i != SQLITE_ROW) && (i != SQLITE_DONE))
+        Error() << "failed to read from database: " << sqlite3_errmsg(_db);
+    sqlite3_int64 rowid = (i == SQLITE_ROW) ? sqlite3_column_int64(_findStmt, 0) : 0;
+    int compression = (i == SQLITE_ROW) ? sqlite3_column_int(_findStmt, 1) : 0;
+    std::vector<size_t> indexMarks;
+    if (i == SQLITE_ROW)
+    {
+        const uint8_t* p = (const uint8_t*) sqlite3_column_blob(_findStmt, 2);
+        int len = sqlite3_column_bytes(_findStmt, 2);
+        for (int j=0; (j+4) <= len; j += 4)
+            indexMarks.push_back(p[j] | (p[j+1]<<8) | (p[j+2]<<16) | ((uint32_t)p[j+3]<<24));
+    }
+    sqlCheck(_db, sqlite3_reset(_findStmt));
+    if (i == SQLITE_DONE)
+        return fluxmap;
+
+    if (_blob)
+        i = sqlite3_blob_reopen(_blob, rowid);
+    else
+        i = sqlite3_blob_open(_db, "main", "rawdata", "data", rowid, 0, &_blob);
+    if (i != SQLITE_OK)
+    {
+        /* A failed reopen leaves the handle aborted, so start again. */
+        sqlite3_blob_close(_blob);
+        _blob = NULL;
+        sqlCheck(_db, sqlite3_blob_open(_db, "main", "rawdata", "data", rowid, 0, &_blob));
+    }
+
+    std::vector<uint8_t> data(sqlite3_blob_bytes(_blob));
+    if (!data.empty())
+        sqlCheck(_db, sqlite3_blob_read(_blob, &data[0], data.size(), 0));
+
+    switch (compression)
     {
-        if (i != SQLITE_ROW)
-            Error() << "failed to read from database: " << sqlite3_errmsg(db);
+        case FLUX_UNCOMPRESSED:
+            break;
 
-        const uint8_t* blobptr = (const uint8_t*) sqlite3_column_blob(stmt, 0);
-        size_t bloblen = sqlite3_column_bytes(stmt, 0);
+        case FLUX_HUFFMAN:
+            data = huffmanDecompress(data.data(), data.size());
+            break;
 
-        fluxmap->appendIntervals(blobptr, bloblen);
+        default:
+            Error() << "flux for track " << track << " side " << side
+                    << " uses unknown compression " << compression;
     }
-    sqlCheck(db, sqlite3_finalize(stmt));
+
+    for (size_t j=0; j<indexMarks.size(); j++)
+    {
+        if ((indexMarks[j] > data.size()) || (j && (indexMarks[j] < indexMarks[j-1])))
+            Error() << "flux for track " << track << " side " << side
+                    << " has bad index marks";
+    }
+
+    fluxmap->appendBytes(data.data(), data.size(), indexMarks);
     return fluxmap;
 }
 
@@ -10,9 +10,29 @@ extern sqlite3* sqlOpen(const std::string filename, int flags);
 extern void sqlClose(sqlite3* db);
 extern void sqlStmt(sqlite3* db, const char* sql);
 
-extern void sqlPrepareFlux(sqlite3* db);
-extern void sqlWriteFlux(sqlite3* db, int track, int side, const Fluxmap& fluxmap);
-extern std::unique_ptr<Fluxmap> sqlReadFlux(sqlite3* db, int track, int side);
+/*
+ * A .flux file, held open with its statements prepared for as long as the
+ * store lives. Writes are batched into transactions, which are committed
+ * when the store is destroyed.
+ */
+class SqlFluxStore
+{
+public:
+    SqlFluxStore(const std::string& filename, int flags);
+    ~SqlFluxStore();
+
+    void writeFlux(int track, int side, const Fluxmap& fluxmap);
+    std::unique_ptr<Fluxmap> readFlux(int track, int side);
+
+private:
+    void commit();
+
+    sqlite3* _db;
+    sqlite3_stmt* _writeStmt = NULL;
+    sqlite3_stmt* _findStmt = NULL;
+    sqlite3_blob* _blob = NULL;
+    unsigned _pendingWrites = 0;
+};
 
 #if 0
 extern void sqlfor_all_flux_data(sqlite3* db, void (*cb)(int track, int side, const struct fluxmap* fluxmap));
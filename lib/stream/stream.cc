@@ -1,14 +1,39 @@
 #include "globals.h"
 #include "fluxmap.h"
 #include "stream.h"
+#include "mappedfile.h"
 #include "protocol.h"
 #include "fmt/format.h"
-#include <fstream>
 #include <glob.h>
+#include <algorithm>
 
 #define SCLK_HZ 24027428.57142857
 #define TICKS_PER_SCLK (TICK_FREQUENCY / SCLK_HZ)
 
+#define OOB_INDEX 0x02
+#define OOB_EOF   0x0d
+
+/* The most intervals a single flux can turn into (a Flux3 after an Ovl16). */
+#define MAX_FLUX_INTERVALS 2
+
+/* Flux1 values are all short, so their conversions are precalculated. */
+class Flux1Table
+{
+public:
+    Flux1Table()
+    {
+        for (int i=0; i<0x100; i++)
+            _table[i] = (int)((double)i * TICKS_PER_SCLK);
+    }
+
+    uint8_t operator [] (uint8_t sclk) const { return _table[sclk]; }
+
+private:
+    uint8_t _table[0x100];
+};
+
+static const Flux1Table flux1Ticks;
+
 std::unique_ptr<Fluxmap> readStream(const std::string& path, unsigned track, unsigned side)
 {
     std::string suffix = fmt::format("{:02}.{}.raw", track, side);
@@ -21,92 +46,169 @@ std::unique_ptr<Fluxmap> readStream(const std::string& path, unsigned track, uns
     std::string filename = globdata.gl_pathv[0];
     globfree(&globdata);
 
-    std::ifstream f(filename, std::ios::in | std::ios::binary);
-    if (!f.is_open())
-		Error() << fmt::format("cannot open input file '{}'", filename);
+    MappedFile f(filename);
+    const uint8_t* p = f.data();
+    const uint8_t* end = p + f.size();
 
-    std::unique_ptr<Fluxmap> fluxmap(new Fluxmap);
-    auto writeFlux = [&](uint32_t sclk)
+    /*
+     * Intervals are written straight into a buffer which is handed to the
+     * fluxmap at the end. There's always room past outend for the longest
+     * possible flux, so nothing needs checking until after each one is
+     * written; and as no flux produces more intervals than it took stream
+     * bytes, the buffer hardly ever grows.
+     */
+    std::vector<uint16_t> intervals(f.size() + MAX_FLUX_INTERVALS);
+    uint16_t* out = intervals.data();
+    uint16_t* outend = out + intervals.size() - MAX_FLUX_INTERVALS;
+
+    auto grow = [&]()
+    {
+        size_t used = out - intervals.data();
+        intervals.resize(intervals.size() * 2);
+        out = intervals.data() + used;
+        outend = intervals.data() + intervals.size() - MAX_FLUX_INTERVALS;
+    };
+
+    /* Ticks from Ovl16s, to be added to the next flux. */
+    double overflow = 0.0;
+
+    auto writeLongFlux = [&](uint32_t sclk)
     {
-        int ticks = (double)sclk * TICKS_PER_SCLK;
-        while (ticks >= 0x100)
+        int ticks = std::max(1, (int)(overflow + (double)sclk * TICKS_PER_SCLK));
+        overflow = 0.0;
+        if (ticks > 0xffff)
         {
-            fluxmap->appendInterval(0);
-            ticks -= 0x100;
+            *out++ = 0;
+            ticks -= 0xffff;
         }
-        fluxmap->appendInterval((uint8_t)ticks);
+        *out++ = ticks;
+        if (out >= outend)
+            grow();
     };
 
-    for (;;)
+    /*
+     * Index blocks refer to positions in the stream (not counting OOB
+     * blocks), and usually turn up after the flux they refer to. Flux1
+     * produces one interval per stream byte, so the two only drift apart
+     * on the rarer opcodes; whenever they do, the new difference is noted.
+     */
+    const uint8_t* start = p;
+    size_t oobBytes = 0;
+    std::vector<std::pair<size_t, ptrdiff_t>> offsets = { { 0, 0 } };
+    std::vector<size_t> indexPositions;
+
+    auto checkpoint = [&]()
     {
-        int b = f.get(); /* returns -1 or UNSIGNED char */
-        if (b == -1)
-            break;
-        uint64_t here = f.tellg();
+        size_t streamPos = (p - start) - oobBytes;
+        ptrdiff_t offset = (ptrdiff_t)(out - intervals.data()) - (ptrdiff_t)streamPos;
+        if (offset != offsets.back().second)
+            offsets.push_back(std::make_pair(streamPos, offset));
+    };
+
+    auto need = [&](size_t bytes)
+    {
+        if ((size_t)(end - p) < bytes)
+            Error() << fmt::format("'{}' is truncated", filename);
+    };
 
-        switch (b)
+    while (p < end)
+    {
+        uint8_t b = *p++;
+
+        /* Flux1 is by far the most common, so it's tested for first. */
+        if (b >= 0x0e)
         {
-            case 0x0d: /* OOB block */
+            /* Flux1: single byte value */
+            if (overflow != 0.0)
+                writeLongFlux(b);
+            else
             {
-                int blocktype = f.get();
-                int blocklen = f.get() | (f.get()<<8);
-                if (f.fail() || f.eof())
-                    goto finished;
+                *out++ = flux1Ticks[b];
+                if (out >= outend)
+                    grow();
+            }
+            continue;
+        }
 
-                f.seekg(here + blocklen, std::ios_base::beg);
+        if (b <= 0x07)
+        {
+            /* Flux2: double byte value */
+            need(1);
+            writeLongFlux((b<<8) | *p++);
+        }
+        else switch (b)
+        {
+            case 0x08: /* Nop1: do nothing */
                 break;
-            }
 
-            default:
-            {
-                if ((b >= 0x00) && (b <= 0x07))
-                {
-                    /* Flux2: double byte value */
-                    b = (b<<8) | f.get();
-                    writeFlux(b);
-                }
-                else if (b == 0x08)
-                {
-                    /* Nop1: do nothing */
-                }
-                else if (b == 0x09)
-                {
-                    /* Nop2: skip one byte */
-                    f.seekg(1, std::ios_base::cur);
-                }
-                else if (b == 0x0a)
-                {
-                    /* Nop3: skip two bytes */
-                    f.seekg(2, std::ios_base::cur);
-                }
-                else if (b == 0x0b)
-                {   /* Ovl16: the next block is 0x10000 sclks longer than normal.
-                     * FluxEngine can't handle long transitions, and implementing
-                     * this is complicated, so we just bodge it.
-                     */
-                    writeFlux(0x10000);
-                }
-                else if (b == 0x0c)
-                {
-                    /* Flux3: triple byte value */
-                    int ticks = f.get() << 8;
-                    ticks |= f.get();
-                    writeFlux(ticks);
-                }
-                else if ((b >= 0x0e) && (b <= 0xff))
+            case 0x09: /* Nop2: skip one byte */
+                need(1);
+                p += 1;
+                break;
+
+            case 0x0a: /* Nop3: skip two bytes */
+                need(2);
+                p += 2;
+                break;
+
+            case 0x0b:
+                /* Ovl16: the next flux is 0x10000 sclks longer than normal.
+                 * Whole continuations are written straight away, so that
+                 * the next flux never needs more than two intervals.
+                 */
+                overflow += 0x10000 * TICKS_PER_SCLK;
+                if (overflow > 0xffff)
                 {
-                    /* Flux1: single byte value */
-                    writeFlux(b);
+                    *out++ = 0;
+                    overflow -= 0xffff;
+                    if (out >= outend)
+                        grow();
                 }
-                else
-                    Error() << fmt::format(
-                        "unknown stream block byte 0x{:02x} at 0x{:08x}", b, here);
+                break;
+
+            case 0x0c: /* Flux3: triple byte value */
+                need(2);
+                writeLongFlux((p[0] << 8) | p[1]);
+                p += 2;
+                break;
+
+            case 0x0d: /* OOB block */
+            {
+                if ((end - p) < 3)
+                    goto finished;
+                int blocktype = p[0];
+                int blocklen = p[1] | (p[2]<<8);
+                p += 3;
+
+                /* The EOF block's length is bogus; nothing follows it. */
+                if (blocktype == OOB_EOF)
+                    goto finished;
+                need(blocklen);
+                if ((blocktype == OOB_INDEX) && (blocklen >= 4))
+                    indexPositions.push_back(p[0] | (p[1]<<8) | (p[2]<<16) | (p[3]<<24));
+                p += blocklen;
+                oobBytes += 4 + blocklen;
+                break;
             }
         }
+
+        checkpoint();
     }
 
 finished:
-    if (!f.eof())
-        Error() << fmt::format("I/O error reading '{}'", filename);
+    size_t length = out - intervals.data();
+    intervals.resize(length);
+
+    std::unique_ptr<Fluxmap> fluxmap(new Fluxmap);
+    fluxmap->appendIntervals(std::move(intervals));
+
+    std::sort(indexPositions.begin(), indexPositions.end());
+    for (size_t streamPos : indexPositions)
+    {
+        auto i = std::upper_bound(offsets.begin(), offsets.end(),
+            std::make_pair(streamPos, PTRDIFF_MAX)) - 1;
+        ptrdiff_t position = (ptrdiff_t)streamPos + i->second;
+        fluxmap->addIndexMark(std::min((size_t)std::max<ptrdiff_t>(position, 0), length));
+    }
     return fluxmap;
 }
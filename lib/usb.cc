@@ -2,12 +2,21 @@
 #include "usb.h"
 #include "protocol.h"
 #include "fluxmap.h"
+#include "flags.h"
 #include <endian.h>
 #include <libusb.h>
+#include <deque>
 
 #define TIMEOUT 5000
 
-static libusb_device_handle* device;
+/* Reads are streamed through this many transfers of this size at once. */
+#define READ_TRANSFER_COUNT 8
+#define READ_TRANSFER_SIZE (16*1024)
+
+static StringFlag simulate(
+    { "--simulate" },
+    "Talk to a simulated FluxEngine instead of real hardware; either a .flux file to serve, or 'synthetic'.",
+    "");
 
 static uint8_t buffer[FRAME_SIZE];
 
@@ -16,52 +25,228 @@ static std::string usberror(int i)
     return libusb_strerror((libusb_error) i);
 }
 
-static void usb_init()
+static std::string transfer_status(int status)
 {
-    if (device)
-        return;
+    switch (status)
+    {
+        case LIBUSB_TRANSFER_TIMED_OUT: return "timed out";
+        case LIBUSB_TRANSFER_STALL:     return "endpoint stalled";
+        case LIBUSB_TRANSFER_NO_DEVICE: return "device disconnected";
+        case LIBUSB_TRANSFER_OVERFLOW:  return "overflow";
+        default:                        return "transfer error";
+    }
+}
+
+/*
+ * Keeps several bulk IN transfers queued on the device so that there's always
+ * a buffer waiting for the next packet, and hands each one to the callback
+ * as it completes. The device ends the stream with a short (or zero length)
+ * packet; anything still queued after that is cancelled.
+ */
+class ReadStream
+{
+public:
+    ReadStream(libusb_device_handle* device, const UsbReadCallback& callback):
+        _callback(callback),
+        _slots(READ_TRANSFER_COUNT)
+    {
+        for (auto& slot : _slots)
+        {
+            slot.stream = this;
+            slot.buffer.resize(READ_TRANSFER_SIZE);
+            slot.transfer = libusb_alloc_transfer(0);
+            if (!slot.transfer)
+                Error() << "cannot allocate USB transfer";
+            libusb_fill_bulk_transfer(slot.transfer, device, FLUXENGINE_DATA_IN_EP,
+                &slot.buffer[0], slot.buffer.size(), completed_cb, &slot, TIMEOUT);
+        }
+    }
 
-    int i = libusb_init(NULL);
-    if (i < 0)
-        Error() << "could not start libusb: " << usberror(i);
+    ~ReadStream()
+    {
+        for (auto& slot : _slots)
+            libusb_free_transfer(slot.transfer);
+    }
 
-    device = libusb_open_device_with_vid_pid(NULL, FLUXENGINE_VID, FLUXENGINE_PID);
-    if (!device)
-		Error() << "cannot find the FluxEngine (is it plugged in?)";
-    
-    int cfg = -1;
-    libusb_get_configuration(device, &cfg);
-    if (cfg != 1)
+    void run()
+    {
+        for (auto& slot : _slots)
+            submit(slot);
+
+        while (!_pending.empty())
+        {
+            int i = libusb_handle_events(NULL);
+            if (i < 0)
+                Error() << "failed to handle USB events: " << usberror(i);
+        }
+
+        if (_error)
+            Error() << "data transfer failed: " << transfer_status(_error);
+    }
+
+private:
+    struct Slot
+    {
+        ReadStream* stream;
+        libusb_transfer* transfer;
+        std::vector<uint8_t> buffer;
+        bool done = false;
+    };
+
+    static void LIBUSB_CALL completed_cb(libusb_transfer* transfer)
+    {
+        Slot* slot = (Slot*) transfer->user_data;
+        slot->done = true;
+        slot->stream->completed();
+    }
+
+    void submit(Slot& slot)
+    {
+        if (_finished)
+            return;
+        int i = libusb_submit_transfer(slot.transfer);
+        if (i < 0)
+            Error() << "data transfer failed: " << usberror(i);
+        _pending.push_back(&slot);
+    }
+
+    /* Transfers on one endpoint complete in order, but don't rely on it. */
+    void completed()
+    {
+        while (!_pending.empty() && _pending.front()->done)
+        {
+            Slot& slot = *_pending.front();
+            _pending.pop_front();
+            slot.done = false;
+
+            libusb_transfer* transfer = slot.transfer;
+            if (_finished)
+                continue;
+
+            if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
+            {
+                _callback(transfer->buffer, transfer->actual_length);
+
+                if (transfer->actual_length < transfer->length)
+                    _finished = true;
+                else
+                    submit(slot);
+            }
+            else
+            {
+                _error = transfer->status;
+                _finished = true;
+            }
+        }
+
+        if (_finished)
+        {
+            for (Slot* slot : _pending)
+                libusb_cancel_transfer(slot->transfer);
+        }
+    }
+
+    const UsbReadCallback& _callback;
+    std::vector<Slot> _slots;
+    std::deque<Slot*> _pending;
+    bool _finished = false;
+    int _error = 0;
+};
+
+class LibusbFluxEngine : public FluxEngineDevice
+{
+public:
+    LibusbFluxEngine()
     {
-        i = libusb_set_configuration(device, 1);
+        int i = libusb_init(NULL);
         if (i < 0)
-            Error() << "the FluxEngine would not accept configuration: " << usberror(i);
+            Error() << "could not start libusb: " << usberror(i);
+
+        _device = libusb_open_device_with_vid_pid(NULL, FLUXENGINE_VID, FLUXENGINE_PID);
+        if (!_device)
+            Error() << "cannot find the FluxEngine (is it plugged in?)";
+
+        int cfg = -1;
+        libusb_get_configuration(_device, &cfg);
+        if (cfg != 1)
+        {
+            i = libusb_set_configuration(_device, 1);
+            if (i < 0)
+                Error() << "the FluxEngine would not accept configuration: " << usberror(i);
+        }
+
+        i = libusb_claim_interface(_device, 0);
+        if (i < 0)
+            Error() << "could not claim interface: " << usberror(i);
+    }
+
+    void sendCommand(const void* frame, int len)
+    {
+        int i = libusb_interrupt_transfer(_device, FLUXENGINE_CMD_OUT_EP,
+            (uint8_t*) frame, len, &len, TIMEOUT);
+        if (i < 0)
+            Error() << "failed to send command: " << usberror(i);
+    }
+
+    void receiveReply(void* frame, int len)
+    {
+        int i = libusb_interrupt_transfer(_device, FLUXENGINE_CMD_IN_EP,
+           (uint8_t*) frame, len, &len, TIMEOUT);
+        if (i < 0)
+            Error() << "failed to receive command reply: " << usberror(i);
+    }
+
+    void receiveData(uint8_t* buffer, int len)
+    {
+        bulkTransfer(FLUXENGINE_DATA_IN_EP, buffer, len);
+    }
+
+    void receiveStream(const UsbReadCallback& callback)
+    {
+        ReadStream(_device, callback).run();
+    }
+
+    void sendData(const uint8_t* buffer, int len)
+    {
+        bulkTransfer(FLUXENGINE_DATA_OUT_EP, (uint8_t*) buffer, len);
+    }
+
+private:
+    void bulkTransfer(int ep, uint8_t* buffer, int len)
+    {
+        int i = libusb_bulk_transfer(_device, ep, buffer, len, &len, TIMEOUT);
+        if (i < 0)
+            Error() << "data transfer failed: " << usberror(i);
     }
 
-    i = libusb_claim_interface(device, 0);
-    if (i < 0)
-        Error() << "could not claim interface: " << usberror(i);
+    libusb_device_handle* _device;
+};
+
+static std::unique_ptr<FluxEngineDevice> device;
+
+static void usb_init()
+{
+    if (device)
+        return;
+
+    if (simulate.value.empty())
+        device.reset(new LibusbFluxEngine());
+    else
+        device = createSimulatedFluxEngine(simulate.value);
 
     int version = usbGetVersion();
     if (version > FLUXENGINE_VERSION)
         Error() << "this version of the client is too old for this FluxEngine";
 }
 
-static int usb_cmd_send(void* ptr, int len)
+static void usb_cmd_send(void* ptr, int len)
 {
-    int i = libusb_interrupt_transfer(device, FLUXENGINE_CMD_OUT_EP,
-        (uint8_t*) ptr, len, &len, TIMEOUT);
-    if (i < 0)
-        Error() << "failed to send command: " << usberror(i);
-    return len;
+    device->sendCommand(ptr, len);
 }
 
-void usb_cmd_recv(void* ptr, int len)
+static void usb_cmd_recv(void* ptr, int len)
 {
-    int i = libusb_interrupt_transfer(device, FLUXENGINE_CMD_IN_EP,
-       (uint8_t*)  ptr, len, &len, TIMEOUT);
-    if (i < 0)
-        Error() << "failed to receive command reply: " << usberror(i);
+    device->receiveReply(ptr, len);
 }
 
 static void bad_reply(void)
@@ -136,15 +321,6 @@ nanoseconds_t usbGetRotationalPeriod(void)
     return r->period_ms * 1000;
 }
 
-static int large_bulk_transfer(int ep, std::vector<uint8_t>& buffer)
-{
-    int len;
-    int i = libusb_bulk_transfer(device, ep, &buffer[0], buffer.size(), &len, TIMEOUT);
-    if (i < 0)
-        Error() << "data transfer failed: " << usberror(i);
-    return len;
-}
-
 void usbTestBulkTransport()
 {
     usb_init();
@@ -159,7 +335,7 @@ void usbTestBulkTransport()
 
     std::vector<uint8_t> bulk_buffer(XSIZE*YSIZE*ZSIZE);
     double start_time = getCurrentTime();
-    large_bulk_transfer(FLUXENGINE_DATA_IN_EP, bulk_buffer);
+    device->receiveData(&bulk_buffer[0], bulk_buffer.size());
     double elapsed_time = getCurrentTime() - start_time;
 
     std::cout << "Transferred "
@@ -186,8 +362,11 @@ void usbTestBulkTransport()
     await_reply<struct any_frame>(F_FRAME_BULK_TEST_REPLY);
 }
 
-std::unique_ptr<Fluxmap> usbRead(int side, int revolutions)
+std::unique_ptr<Fluxmap> usbRead(int side, int revolutions,
+    const UsbReadCallback& callback)
 {
+    usb_init();
+
     struct read_frame f = {
         .f = { .type = F_FRAME_READ_CMD, .size = sizeof(f) },
         .side = (uint8_t) side,
@@ -196,12 +375,14 @@ std::unique_ptr<Fluxmap> usbRead(int side, int revolutions)
     usb_cmd_send(&f, f.f.size);
 
     auto fluxmap = std::unique_ptr<Fluxmap>(new Fluxmap);
-
-    std::vector<uint8_t> buffer(1024*1024);
-    int len = large_bulk_transfer(FLUXENGINE_DATA_IN_EP, buffer);
-    buffer.resize(len);
-
-    fluxmap->appendIntervals(buffer);
+    device->receiveStream(
+        [&](const uint8_t* data, size_t len)
+        {
+            fluxmap->appendBytes(data, len);
+            if (callback)
+                callback(data, len);
+        }
+    );
 
     await_reply<struct any_frame>(F_FRAME_READ_REPLY);
     return fluxmap;
@@ -209,7 +390,10 @@ std::unique_ptr<Fluxmap> usbRead(int side, int revolutions)
 
 void usbWrite(int side, const Fluxmap& fluxmap)
 {
-    unsigned safelen = fluxmap.bytes() & ~(FRAME_SIZE-1);
+    usb_init();
+
+    std::vector<uint8_t> bytes = fluxmap.toBytes();
+    unsigned safelen = bytes.size() & ~(FRAME_SIZE-1);
 
     /* Convert from intervals to absolute timestamps. */
 
@@ -217,7 +401,7 @@ void usbWrite(int side, const Fluxmap& fluxmap)
     uint8_t clock = 0;
     for (unsigned i=0; i<safelen; i++)
     {
-        clock += fluxmap[i];
+        clock += bytes[i];
         buffer[i] = clock;
     }
 
@@ -228,13 +412,15 @@ void usbWrite(int side, const Fluxmap& fluxmap)
     };
     usb_cmd_send(&f, f.f.size);
 
-    large_bulk_transfer(FLUXENGINE_DATA_OUT_EP, buffer);
+    device->sendData(&buffer[0], buffer.size());
     
     await_reply<struct any_frame>(F_FRAME_WRITE_REPLY);
 }
 
 void usbErase(int side)
 {
+    usb_init();
+
     struct erase_frame f = {
         .f = { .type = F_FRAME_ERASE_CMD, .size = sizeof(f) },
         .side = (uint8_t) side,
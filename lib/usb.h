@@ -3,12 +3,44 @@
 
 class Fluxmap;
 
+/* Called with each chunk of raw flux as it arrives from the device. */
+typedef std::function<void(const uint8_t* data, size_t len)> UsbReadCallback;
+
+/*
+ * The raw endpoints of a FluxEngine: command frames out, reply frames in,
+ * and bulk data in either direction. This is either real hardware (via
+ * libusb) or the simulator, selected with --simulate.
+ */
+class FluxEngineDevice
+{
+public:
+    virtual ~FluxEngineDevice() {}
+
+    virtual void sendCommand(const void* frame, int len) = 0;
+    virtual void receiveReply(void* frame, int len) = 0;
+
+    /* Receives exactly len bytes of bulk data. */
+    virtual void receiveData(uint8_t* buffer, int len) = 0;
+
+    /* Receives bulk data until the device ends the stream. */
+    virtual void receiveStream(const UsbReadCallback& callback) = 0;
+
+    virtual void sendData(const uint8_t* buffer, int len) = 0;
+};
+
+extern std::unique_ptr<FluxEngineDevice> createSimulatedFluxEngine(
+    const std::string& source);
+
+/* How far a simulated FluxEngine's own clock has got, in ticks. */
+extern uint64_t simulatedFluxEngineTime(const FluxEngineDevice& device);
+
 extern int usbGetVersion();
 extern void usbRecalibrate();
 extern void usbSeek(int track);
 extern nanoseconds_t usbGetRotationalPeriod();
 extern void usbTestBulkTransport();
-extern std::unique_ptr<Fluxmap> usbRead(int side, int revolutions);
+extern std::unique_ptr<Fluxmap> usbRead(int side, int revolutions,
+    const UsbReadCallback& callback = UsbReadCallback());
 extern void usbWrite(int side, const Fluxmap& fluxmap);
 extern void usbErase(int side);
 extern void usbSetDrive(int drive);
@@ -0,0 +1,29 @@
+#ifndef VOTING_H
+#define VOTING_H
+
+class Sector;
+class RecordParser;
+
+/*
+ * Collects every copy read of one sector, from several revolutions or
+ * several reads, and combines them. A good copy wins outright; otherwise the
+ * raw bytes of the copies are voted on byte by byte, so that copies with
+ * errors in different places can outvote each other, and the result is
+ * checked against its checksum.
+ */
+class SectorVoter
+{
+public:
+    void add(std::unique_ptr<Sector> sector);
+
+    unsigned copies() const { return _copies.size(); }
+    bool hasGoodCopy() const;
+
+    /* Returns the best sector which can be made of the copies so far. */
+    std::unique_ptr<Sector> vote(const RecordParser& parser) const;
+
+private:
+    std::vector<std::unique_ptr<Sector>> _copies;
+};
+
+#endif
@@ -1,6 +1,7 @@
 #include "globals.h"
 #include "flags.h"
 #include "fluxmap.h"
+#include "bitstream.h"
 #include "writer.h"
 #include "sql.h"
 #include "protocol.h"
@@ -13,7 +14,7 @@ static DataSpecFlag dest(
     "destination for data",
     ":t=0-79:s=0-1");
 
-static sqlite3* outdb;
+static std::unique_ptr<SqlFluxStore> outdb;
 
 void setWriterDefaultDest(const std::string& dest)
 {
@@ -29,15 +30,7 @@ void writeTracks(
 
 	if (!spec.filename.empty())
 	{
-		outdb = sqlOpen(spec.filename, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
-		sqlPrepareFlux(outdb);
-		sqlStmt(outdb, "BEGIN;");
-		atexit([]()
-			{
-				sqlStmt(outdb, "COMMIT;");
-				sqlClose(outdb);
-			}
-		);
+		outdb.reset(new SqlFluxStore(spec.filename, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE));
 	}
 
     for (const auto& location : spec.locations)
@@ -57,19 +50,19 @@ void writeTracks(
         {
             fluxmap->precompensate(PRECOMPENSATION_THRESHOLD_TICKS, 2);
             if (outdb)
-                sqlWriteFlux(outdb, location.track, location.side, *fluxmap);
+                outdb->writeFlux(location.track, location.side, *fluxmap);
             else
             {
                 usbSeek(location.track);
                 usbWrite(location.side, *fluxmap);
             }
             std::cout << fmt::format(
-                "{0} ms in {1} bytes", int(fluxmap->duration()/1e6), fluxmap->bytes()) << std::endl;
+                "{0} ms in {1} intervals", int(fluxmap->ticks() * MS_PER_TICK), fluxmap->size()) << std::endl;
         }
     }
 }
 
-void fillBitmapTo(std::vector<bool>& bitmap,
+void fillBitmapTo(Bitstream& bitmap,
 	unsigned& cursor, unsigned terminateAt,
 	const std::vector<bool>& pattern)
 {
@@ -78,7 +71,7 @@ void fillBitmapTo(std::vector<bool>& bitmap,
 		for (bool b : pattern)
 		{
 			if (cursor < bitmap.size())
-				bitmap[cursor++] = b;
+				bitmap.set(cursor++, b);
 		}
 	}
 }
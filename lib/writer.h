@@ -2,12 +2,13 @@
 #define WRITER_H
 
 class Fluxmap;
+class Bitstream;
 
 extern void setWriterDefaultDest(const std::string& dest);
 
 extern void writeTracks(const std::function<std::unique_ptr<Fluxmap>(int track, int side)> producer);
 
-extern void fillBitmapTo(std::vector<bool>& bitmap,
+extern void fillBitmapTo(Bitstream& bitmap,
 		unsigned& cursor, unsigned terminateAt,
 		const std::vector<bool>& pattern);
 	
@@ -2,6 +2,7 @@
 #include "flags.h"
 #include "reader.h"
 #include "fluxmap.h"
+#include "bitstream.h"
 #include "decoders.h"
 #include "image.h"
 #include "protocol.h"
@@ -9,8 +10,8 @@
 
 static DoubleFlag clockScaleFlag(
 	{ "--clock-scale" },
-	"Scale the clock by this much after detection (use 0.5 for MFM, 1.0 for anything else).",
-	0.5);
+	"Scale the clock by this much after detection (use 0.5 for MFM, 1.0 for anything else, or 0 to guess from the encoding).",
+	0.0);
 
 static SettableFlag dumpFluxFlag(
 	{ "--dump-flux", "-F" },
@@ -20,6 +21,16 @@ static SettableFlag dumpBitstreamFlag(
 	{ "--dump-bitstream", "-B" },
 	"Dump aligned bitstream.");
 
+static DoubleFlag dumpStartFlag(
+	{ "--dump-start" },
+	"Start dumping flux this far into the track (microseconds).",
+	0.0);
+
+static DoubleFlag dumpLengthFlag(
+	{ "--dump-length" },
+	"Only dump this much flux (microseconds). 0 for all of it",
+	0.0);
+
 static IntFlag fluxmapResolutionFlag(
 	{ "--fluxmap-resolution" },
 	"Resolution of flux visualisation (nanoseconds). 0 to autoscale",
@@ -39,11 +50,19 @@ int main(int argc, const char* argv[])
 	nanoseconds_t clockPeriod = fluxmap->guessClock();
 	std::cout << fmt::format("       {:.2f} us clock detected; ", (double)clockPeriod/1000.0) << std::flush;
 
-	clockPeriod *= clockScaleFlag;
+	if (clockScaleFlag == 0.0)
+	{
+		auto guesses = guessEncodings(*fluxmap);
+		if (guesses.empty())
+			Error() << "couldn't guess the encoding; try --clock-scale";
+		std::cout << fmt::format("looks like {}; ", encodingToString(guesses.front().encoding));
+		clockPeriod = guesses.front().clockPeriod;
+	}
+	else
+		clockPeriod *= clockScaleFlag;
 	std::cout << fmt::format("{:.2f} us bit clock; ", (double)clockPeriod/1000.0) << std::flush;
 
-	auto bitmap = fluxmap->decodeToBits(clockPeriod);
-	std::cout << fmt::format("{} bytes encoded.", bitmap.size()/8) << std::endl;
+	std::cout << fmt::format("{} bytes encoded.", (size_t)(fluxmap->ticks() * NS_PER_TICK / clockPeriod / 8)) << std::endl;
 
 	if (dumpFluxFlag)
 	{
@@ -54,18 +73,30 @@ int main(int argc, const char* argv[])
 		if (resolution == 0)
 			resolution = clockPeriod / 4;
 
-		nanoseconds_t now = 0;
-		nanoseconds_t nextclock = clockPeriod;
-		int ticks = 0;
-		std::cout << fmt::format("{: 10.3f}:-", 0.0);
-		for (int cursor=0; cursor<fluxmap->bytes(); cursor++)
+		/* Jump straight to the first transition in the window. */
+		nanoseconds_t start = dumpStartFlag * 1000.0;
+		nanoseconds_t end = (dumpLengthFlag == 0.0) ? fluxmap->duration()
+			: (start + (nanoseconds_t)(dumpLengthFlag * 1000.0));
+		int cursor = fluxmap->indexAt(dumpStartFlag * TICKS_PER_US);
+		uint64_t ticks = fluxmap->ticksAt(cursor);
+
+		nanoseconds_t now = start / resolution * resolution;
+		nanoseconds_t nextclock = (now / clockPeriod + 1) * clockPeriod;
+		std::cout << fmt::format("{: 10.3f}:-", (double)now / 1000.0);
+		for (; cursor<fluxmap->size(); cursor++)
 		{
 			int interval = (*fluxmap)[cursor];
 			if (interval == 0)
-				interval = 0x100;
+			{
+				/* Part of a long gap; there's no pulse here. */
+				ticks += 0xffff;
+				continue;
+			}
 			ticks += interval;
 
 			nanoseconds_t transition = ticks*NS_PER_TICK;
+			if (transition > end)
+				break;
 			nanoseconds_t next;
 			
 			bool clocked = false;
@@ -84,16 +115,18 @@ int main(int argc, const char* argv[])
 
 			std::cout << fmt::format("==== {: 10.3f}", (double)transition / 1000.0);
 		}
+		std::cout << std::endl;
 	}
 
 	if (dumpBitstreamFlag)
 	{
+		auto bitmap = fluxmap->decodeToBits(clockPeriod);
 		std::cout << "Aligned bitstream of length " << bitmap.size()
 					<< " follows:" << std::endl
 					<< std::endl;
 
-		for (bool bit : bitmap)
-			std::cout << (bit ? 'X' : '-');
+		for (size_t i=0; i<bitmap.size(); i++)
+			std::cout << (bitmap[i] ? 'X' : '-');
 		std::cout << std::endl;
 	}
 
@@ -0,0 +1,109 @@
+#include "globals.h"
+#include "flags.h"
+#include "reader.h"
+#include "fluxmap.h"
+#include "decoders.h"
+#include "brother.h"
+#include "image.h"
+#include "sector.h"
+#include "sectorset.h"
+#include "record.h"
+#include <fmt/format.h>
+
+static StringFlag outputFilename(
+    { "--output", "-o" },
+    "The output image file to write to.",
+    "disk.img");
+
+static IntFlag sectorIdBase(
+	{ "--sector-id-base" },
+	"Sector ID of the first sector, for IBM-style disks.",
+	1);
+
+static SettableFlag trialDecode(
+	{ "--trial-decode" },
+	"Rather than guessing the encoding, decode every track every known way at once and keep whichever reads best.");
+
+static void readDiskByTrial(const std::vector<std::unique_ptr<Track>>& tracks)
+{
+	MfmBitmapDecoder mfmDecoder;
+	FmBitmapDecoder fmDecoder;
+	BrotherBitmapDecoder brotherDecoder;
+	IbmRecordParser mfmParser0(IBM_SCHEME_MFM, 0);
+	IbmRecordParser mfmParser1(IBM_SCHEME_MFM, 1);
+	IbmRecordParser fmParser0(IBM_SCHEME_FM, 0);
+	IbmRecordParser fmParser1(IBM_SCHEME_FM, 1);
+	BrotherRecordParser brotherParser;
+
+	readDiskTrialCommand(tracks,
+		{
+			{ "MFM from sector 0", mfmDecoder, mfmParser0 },
+			{ "MFM from sector 1", mfmDecoder, mfmParser1 },
+			{ "FM from sector 0",  fmDecoder,  fmParser0 },
+			{ "FM from sector 1",  fmDecoder,  fmParser1 },
+			{ "Brother",           brotherDecoder, brotherParser },
+		},
+		outputFilename);
+}
+
+/*
+ * Reads a disk in whatever encoding it turns out to be in: either the first
+ * track is read and its flux examined to pick the decoder and parser for the
+ * rest, or (with --trial-decode) every track is decoded every way.
+ */
+int main(int argc, const char* argv[])
+{
+	setReaderDefaultSource(":t=0-79:s=0-1");
+    Flag::parseFlags(argc, argv);
+
+	auto tracks = readTracks();
+	if (tracks.empty())
+		Error() << "the source dataspec contains no tracks";
+
+	if (trialDecode)
+	{
+		readDiskByTrial(tracks);
+		return 0;
+	}
+
+	std::unique_ptr<Fluxmap> fluxmap = tracks.front()->read();
+	auto guesses = guessEncodings(*fluxmap);
+	if (guesses.empty())
+		Error() << "couldn't find any clock in the first track";
+
+	std::cout << "Encodings by likelihood:" << std::endl;
+	for (const auto& guess : guesses)
+		std::cout << fmt::format("       {}: {:.2f} us bit clock, {:.0f}% fit",
+				encodingToString(guess.encoding), (double)guess.clockPeriod/1000.0,
+				guess.score*100.0)
+			<< std::endl;
+
+	switch (guesses.front().encoding)
+	{
+		case ENCODING_FM:
+		{
+			FmBitmapDecoder bitmapDecoder;
+			IbmRecordParser recordParser(IBM_SCHEME_FM, sectorIdBase);
+			readDiskCommand(tracks, bitmapDecoder, recordParser, outputFilename);
+			break;
+		}
+
+		case ENCODING_MFM:
+		{
+			MfmBitmapDecoder bitmapDecoder;
+			IbmRecordParser recordParser(IBM_SCHEME_MFM, sectorIdBase);
+			readDiskCommand(tracks, bitmapDecoder, recordParser, outputFilename);
+			break;
+		}
+
+		case ENCODING_BROTHER:
+		{
+			BrotherBitmapDecoder bitmapDecoder;
+			BrotherRecordParser recordParser;
+			readDiskCommand(tracks, bitmapDecoder, recordParser, outputFilename);
+			break;
+		}
+	}
+
+    return 0;
+}
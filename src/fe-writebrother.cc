@@ -1,6 +1,7 @@
 #include "globals.h"
 #include "flags.h"
 #include "fluxmap.h"
+#include "bitstream.h"
 #include "sector.h"
 #include "sectorset.h"
 #include "decoders.h"
@@ -70,7 +71,7 @@ int main(int argc, const char* argv[])
 			if ((track < 0) || (track > 77) || (side != 0))
 				return std::unique_ptr<Fluxmap>();
 
-			std::vector<bool> bits(bitsPerRevolution);
+			Bitstream bits(bitsPerRevolution);
 			unsigned cursor = 0;
 
 			for (int sectorCount=0; sectorCount<geometry.sectors; sectorCount++)
@@ -86,7 +87,7 @@ int main(int argc, const char* argv[])
 				fillBitmapTo(bits, cursor, headerCursor, { true, false });
 				writeBrotherSectorHeader(bits, cursor, track, sectorId);
 				fillBitmapTo(bits, cursor, dataCursor, { true, false });
-				writeBrotherSectorData(bits, cursor, sectorData->data);
+				writeBrotherSectorData(bits, cursor, sectorData->data.vector());
 			}
 
 			if (cursor > bits.size())
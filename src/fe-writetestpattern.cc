@@ -24,7 +24,9 @@ int main(int argc, const char* argv[])
     Flag::parseFlags(argc, argv);
 
     unsigned ticksPerInterval = (unsigned) (interval * TICKS_PER_US);
-    if (ticksPerInterval > 0xff)
+    if (ticksPerInterval == 0)
+        Error() << "interval too short";
+    if (ticksPerInterval > 0xffff)
         Error() << "interval too long";
 
     writeTracks(
@@ -32,8 +34,8 @@ int main(int argc, const char* argv[])
         {
 			std::unique_ptr<Fluxmap> fluxmap(new Fluxmap);
 
-            while (fluxmap->duration() < (sequenceLength*1000000.0))
-                fluxmap->appendIntervals({ (uint8_t)ticksPerInterval });
+            while ((fluxmap->ticks() * NS_PER_TICK) < (sequenceLength*1000000.0))
+                fluxmap->appendInterval(ticksPerInterval);
 
 			return fluxmap;
         }
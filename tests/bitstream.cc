@@ -0,0 +1,99 @@
+#include "globals.h"
+#include "bitstream.h"
+#include <assert.h>
+
+static void test_setget(void)
+{
+    Bitstream b(130);
+    assert(b.size() == 130);
+    assert(!b[0] && !b[129]);
+
+    b.set(0, true);
+    b.set(63, true);
+    b.set(64, true);
+    b.set(129, true);
+    assert(b[0] && b[63] && b[64] && b[129]);
+    assert(!b[1] && !b[62] && !b[65]);
+
+    b.set(63, false);
+    assert(!b[63]);
+}
+
+static void test_word(void)
+{
+    Bitstream b(128);
+    b.put(0, 0x4489, 16);
+    assert(b.get(0, 16) == 0x4489);
+    assert(b.get(1, 15) == 0x4489);
+    assert(b.get(2, 16) == ((0x4489 << 2) & 0xffff));
+
+    /* Across a word boundary. */
+    b.put(56, 0x448944894489ULL, 48);
+    assert(b.get(56, 48) == 0x448944894489ULL);
+    assert(b.get(60, 32) == 0x48944894ULL);
+    assert((b.word(56) >> 16) == 0x448944894489ULL);
+
+    /* Past the end reads as zero. */
+    assert(b.word(1000) == 0);
+}
+
+static void test_put_clipped(void)
+{
+    Bitstream b(10);
+    b.put(6, 0xff, 8);
+    assert(b.get(0, 10) == 0x00f);
+
+    b.put(0, 0x3, 2);
+    assert(b.get(0, 10) == 0x30f);
+}
+
+static void test_resize(void)
+{
+    Bitstream b(64);
+    b.put(0, ~0ULL, 64);
+    b.resize(10);
+    b.resize(64);
+    assert(b.get(0, 64) == 0xffc0000000000000ULL);
+
+    Bitstream c;
+    c.push_back(true);
+    c.push_back(false);
+    c.push_back(true);
+    assert(c.size() == 3);
+    assert(c.get(0, 3) == 5);
+}
+
+static void test_find(void)
+{
+    Bitstream b(300);
+    assert(b.find(0x4489, 16) == Bitstream::npos);
+
+    b.put(10, 0x448944894489ULL, 48);
+    b.put(200, 0x448944894489ULL, 48);
+    assert(b.find(0x448944894489ULL, 48) == 10);
+    assert(b.find(0x448944894489ULL, 48, 11) == 200);
+    assert(b.find(0x448944894489ULL, 48, 11, 200) == Bitstream::npos);
+    assert(b.find(0x4489, 16, 11) == 26);
+
+    /* Overlapping and hanging off the end. */
+    b.put(290, 0x4489, 10);
+    assert(b.find(0x4489, 16, 201) == 216);
+    assert(b.find(0x448944894489ULL, 48, 201) == Bitstream::npos);
+
+    /* Patterns with no set bits. */
+    Bitstream ones(70);
+    ones.put(0, ~0ULL, 64);
+    ones.put(64, ~0ULL, 6);
+    ones.set(66, false);
+    assert(ones.find(0, 1) == 66);
+}
+
+int main(int argc, const char* argv[])
+{
+    test_setget();
+    test_word();
+    test_put_clipped();
+    test_resize();
+    test_find();
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include "globals.h"
+#include "crc.h"
+#include <assert.h>
+
+/* The original bit-at-a-time implementations, to check against. */
+
+static uint16_t reference_crc16(uint16_t poly, const uint8_t* start, const uint8_t* end)
+{
+	uint16_t crc = 0xffff;
+	while (start != end)
+	{
+		crc ^= *start++ << 8;
+		for (int i=0; i<8; i++)
+			crc = (crc & 0x8000) ? ((crc<<1)^poly) : (crc<<1);
+	}
+	return crc;
+}
+
+static uint32_t reference_crcbrother(const uint8_t* start, const uint8_t* end)
+{
+	uint32_t crc = *start++;
+	while (start != end)
+	{
+		for (int i=0; i<8; i++)
+			crc = (crc & 0x800000) ? ((crc<<1)^BROTHER_POLY) : (crc<<1);
+		crc ^= *start++;
+	}
+	return crc & 0xFFFFFF;
+}
+
+static std::vector<uint8_t> random_data(size_t len)
+{
+	static uint32_t seed = 1;
+	std::vector<uint8_t> data(len);
+	for (auto& b : data)
+	{
+		seed = seed*1103515245 + 12345;
+		b = seed >> 16;
+	}
+	return data;
+}
+
+static void test_crc16(void)
+{
+	/* The standard check value for CRC-16/CCITT-FALSE. */
+	const uint8_t check[] = "123456789";
+	assert(crc16(CCITT_POLY, check, check+9) == 0x29b1);
+
+	for (size_t len=0; len<700; len++)
+	{
+		auto data = random_data(len);
+		const uint8_t* p = data.data();
+		assert(crc16(CCITT_POLY, p, p+len) == reference_crc16(CCITT_POLY, p, p+len));
+		assert(crc16(0x8005, p, p+len) == reference_crc16(0x8005, p, p+len));
+	}
+}
+
+static void test_crcbrother(void)
+{
+	for (size_t len=1; len<700; len++)
+	{
+		auto data = random_data(len);
+		const uint8_t* p = data.data();
+		assert(crcbrother(p, p+len) == reference_crcbrother(p, p+len));
+	}
+}
+
+static void test_flip(void)
+{
+	for (size_t len : { 1, 7, 64, 518 })
+	{
+		auto data = random_data(len);
+		const uint8_t* p = data.data();
+		uint16_t crc = crc16(CCITT_POLY, p, p+len);
+		uint32_t bcrc = crcbrother(p, p+len);
+		for (size_t bit=0; bit<(len*8); bit += 3)
+		{
+			data[bit/8] ^= 0x80 >> (bit%8);
+			assert(crc16FlipBit(CCITT_POLY, crc, len, bit) == crc16(CCITT_POLY, p, p+len));
+			assert(crcbrotherFlipBit(bcrc, len, bit) == crcbrother(p, p+len));
+			data[bit/8] ^= 0x80 >> (bit%8);
+		}
+	}
+}
+
+int main(int argc, const char* argv[])
+{
+	test_crc16();
+	test_crcbrother();
+	test_flip();
+	return 0;
+}
@@ -0,0 +1,619 @@
+#include "globals.h"
+#include "flags.h"
+#include "fluxmap.h"
+#include "bitstream.h"
+#include "decoders.h"
+#include "brother.h"
+#include "record.h"
+#include "sector.h"
+#include "crc.h"
+#include "protocol.h"
+#include "fluxreader.h"
+#include "reader.h"
+#include <assert.h>
+#include <math.h>
+#include <unistd.h>
+#include <thread>
+#include <stdexcept>
+#include <limits>
+
+/*
+ * Decodes a batch of synthetic tracks on many threads at once and checks
+ * that every thread gets exactly the same answer as a serial run.
+ */
+
+#define TRACKS 24
+#define THREADS 8
+#define PASSES 4
+
+class BitWriter
+{
+public:
+    void raw(uint64_t data, int width)
+    {
+        bits.resize(bits.size() + width);
+        bits.put(bits.size() - width, data, width);
+    }
+
+    void fm(uint8_t byte)
+    {
+        for (int i=7; i>=0; i--)
+            raw(2 | ((byte >> i) & 1), 2);
+    }
+
+    void mfm(uint8_t byte)
+    {
+        for (int i=7; i>=0; i--)
+        {
+            bool bit = (byte >> i) & 1;
+            raw(((!_last && !bit) << 1) | bit, 2);
+            _last = bit;
+        }
+    }
+
+    Bitstream bits;
+
+private:
+    bool _last = false;
+};
+
+static void write_ibm_track(BitWriter& w, bool isMfm, int track, int seed)
+{
+    auto encode = [&](const std::vector<uint8_t>& bytes)
+    {
+        for (uint8_t b : bytes)
+            isMfm ? w.mfm(b) : w.fm(b);
+    };
+    auto gap = [&](uint8_t byte, int count)
+    {
+        encode(std::vector<uint8_t>(count, byte));
+    };
+    auto record = [&](std::vector<uint8_t> bytes)
+    {
+        /* The CRC covers the sync bytes, which FM doesn't have. */
+        std::vector<uint8_t> crcdata = bytes;
+        if (isMfm)
+            crcdata.insert(crcdata.begin(), 3, 0xa1);
+        uint16_t crc = crc16(CCITT_POLY, &crcdata[0], &crcdata[0] + crcdata.size());
+        bytes.push_back(crc >> 8);
+        bytes.push_back(crc);
+
+        gap(0x00, 12);
+        if (isMfm)
+        {
+            w.raw(0x448944894489ULL, 48);
+            encode(bytes);
+        }
+        else
+        {
+            w.raw((bytes[0] == IBM_IDAM) ? 0xf57e : 0xf56f, 16);
+            encode(std::vector<uint8_t>(bytes.begin()+1, bytes.end()));
+        }
+    };
+
+    gap(0x4e, 40 + seed%50);
+    for (int sector=0; sector<9; sector++)
+    {
+        record({ IBM_IDAM, (uint8_t)track, 0, (uint8_t)(sector+1), 2 });
+        gap(0x4e, 22);
+
+        std::vector<uint8_t> dam = { IBM_DAM2 };
+        for (int i=0; i<512; i++)
+            dam.push_back(seed*sector + i*7);
+        record(dam);
+        gap(0x4e, 50);
+    }
+}
+
+static void write_brother_track(BitWriter& w, int track, int seed)
+{
+    for (int sector=0; sector<12; sector++)
+    {
+        std::vector<uint8_t> data(BROTHER_DATA_RECORD_PAYLOAD);
+        for (int i=0; i<BROTHER_DATA_RECORD_PAYLOAD; i++)
+            data[i] = seed + sector*i;
+
+        w.bits.resize(w.bits.size() + 1200);
+        unsigned cursor = w.bits.size();
+        w.bits.resize(cursor + 200);
+        writeBrotherSectorHeader(w.bits, cursor, track, sector);
+        w.bits.resize(cursor + 4000);
+        writeBrotherSectorData(w.bits, cursor, data);
+        w.bits.resize(cursor);
+    }
+}
+
+struct TestTrack
+{
+    const BitmapDecoder* decoder;
+    const RecordParser* parser;
+    Bitstream bits;
+};
+
+static std::string decode(const TestTrack& track)
+{
+    std::stringstream ss;
+    auto records = track.decoder->decodeBitsToRecords(track.bits);
+    for (const auto& record : records)
+    {
+        ss << record->position << ':';
+        for (uint8_t b : record->data)
+            ss << (int)b << ' ';
+        ss << '\n';
+    }
+
+    auto sectors = track.parser->parseRecordsToSectors(records);
+    assert(sectors.size() >= 9);
+    for (const auto& sector : sectors)
+    {
+        assert(sector->status == Sector::OK);
+        ss << sector->track << '.' << sector->side << '.' << sector->sector
+           << '=' << crc16(CCITT_POLY, &sector->data[0], &sector->data[0] + sector->data.size())
+           << '\n';
+    }
+    return ss.str();
+}
+
+/*
+ * Moves one pulse in the middle of a sector into the next cell, and marks it
+ * as weak as decodeToBits() would; the parser should find and undo it.
+ */
+static void test_bit_repair(void)
+{
+    MfmBitmapDecoder decoder;
+    IbmRecordParser parser(IBM_SCHEME_MFM, 1);
+    BitWriter w;
+    write_ibm_track(w, true, 0, 1);
+
+    auto records = decoder.decodeBitsToRecords(w.bits);
+    size_t damPosition = 0;
+    for (const auto& record : records)
+        if (record->data[3] == IBM_DAM2)
+        {
+            damPosition = record->position;
+            break;
+        }
+
+    size_t cell = damPosition + 48 + 8*100*2;
+    while (!(w.bits[cell] && !w.bits[cell+1] && !w.bits[cell+2]))
+        cell++;
+    w.bits.set(cell, false);
+    w.bits.set(cell+1, true);
+    w.bits.addWeakPulse(cell+1, -100);
+
+    auto sectors = parser.parseRecordsToSectors(decoder.decodeBitsToRecords(w.bits));
+    assert(sectors[0]->status == Sector::BAD_CHECKSUM);
+
+    const char* argv[] = { "decoders-test", "--bit-repair-candidates=8" };
+    Flag::parseFlags(2, argv);
+    sectors = parser.parseRecordsToSectors(decoder.decodeBitsToRecords(w.bits));
+    assert(sectors[0]->status == Sector::OK);
+    assert(sectors[0]->repairedBits == 1);
+    for (int i=0; i<512; i++)
+        assert(sectors[0]->data[i] == (uint8_t)(i*7));
+}
+
+static std::string describe(const RecordVector& records)
+{
+    std::stringstream ss;
+    for (const auto& record : records)
+    {
+        ss << record->position << ':';
+        for (uint8_t b : record->data)
+            ss << (int)b << ' ';
+        for (const auto& weakBit : record->weakBits)
+            ss << '~' << weakBit.bit << '/' << weakBit.weakness << ' ';
+        ss << '\n';
+    }
+    return ss.str();
+}
+
+/*
+ * Turns bits into flux, with one interval for each one bit; ticks() says
+ * how long that is, given the bit's position and the cells since the last.
+ */
+static Fluxmap bits_to_flux(const Bitstream& bits,
+    const std::function<unsigned(size_t position, unsigned cells)>& ticks)
+{
+    Fluxmap fluxmap;
+    unsigned cells = 0;
+    for (size_t j=0; j<bits.size(); j++)
+    {
+        cells++;
+        if (bits[j])
+        {
+            fluxmap.appendInterval(ticks(j, cells));
+            cells = 0;
+        }
+    }
+    return fluxmap;
+}
+
+/*
+ * Turns tracks into jittery flux and checks that decoding the flux directly
+ * finds exactly the same records, weak bits and all, as decoding it to bits
+ * first.
+ */
+static void test_flux_decoding(void)
+{
+    const nanoseconds_t clockPeriod = 1000;
+    const int ticksPerCell = clockPeriod / NS_PER_TICK;
+
+    MfmBitmapDecoder mfmDecoder;
+    FmBitmapDecoder fmDecoder;
+    for (int i=0; i<4; i++)
+    {
+        bool isMfm = !(i & 1);
+        const BitmapDecoder& decoder = isMfm
+            ? (const BitmapDecoder&)mfmDecoder : (const BitmapDecoder&)fmDecoder;
+        BitWriter w;
+        write_ibm_track(w, isMfm, i, i);
+        if (i >= 2)
+        {
+            /* Leave the last record unfinished. */
+            w.bits.resize(w.bits.size() - 5000 - i);
+        }
+
+        uint32_t seed = i;
+        Fluxmap fluxmap = bits_to_flux(w.bits,
+            [&](size_t position, unsigned cells)
+            {
+                seed = seed*1103515245 + 12345;
+                int jitter = (int)((seed >> 16) % 5) - 2;
+                return cells*ticksPerCell + jitter;
+            });
+
+        auto expected = decoder.decodeBitsToRecords(fluxmap.decodeToBits(clockPeriod));
+        auto records = decoder.decodeFluxToRecords(fluxmap, clockPeriod);
+        assert(records.size() == 18);
+        assert(describe(records) == describe(expected));
+    }
+}
+
+/* A track longer than a nanoseconds_t can time still decodes all the way. */
+static void test_long_track(void)
+{
+    const nanoseconds_t clockPeriod = 1000;
+    const int ticksPerCell = clockPeriod / NS_PER_TICK;
+    const size_t count = 3 * TICK_FREQUENCY / (ticksPerCell*2);
+
+    Fluxmap fluxmap;
+    fluxmap.appendIntervals(std::vector<uint16_t>(count, ticksPerCell*2));
+    assert(fluxmap.ticks() * NS_PER_TICK > std::numeric_limits<nanoseconds_t>::max());
+
+    for (bool pll : { false, true })
+    {
+        Bitstream bits = pll
+            ? fluxmap.decodeToBitsWithPll(clockPeriod, 0.65, 0.04, 0.8)
+            : fluxmap.decodeToBits(clockPeriod);
+        assert(bits.size() >= count*2);
+        size_t ones = 0;
+        for (size_t i=0; i<bits.size(); i++)
+            ones += bits[i];
+
+        /* The very last pulse may land just past the end. */
+        assert(ones >= count-1);
+    }
+}
+
+/* Serves synthetic IBM tracks, as if from a drive. */
+class SyntheticFluxReader : public FluxReader
+{
+public:
+    SyntheticFluxReader(bool isMfm): _isMfm(isMfm) {}
+
+    std::unique_ptr<Fluxmap> readFlux(int track, int side)
+    {
+        const int ticksPerCell = 1000 / NS_PER_TICK;
+        BitWriter w;
+        write_ibm_track(w, _isMfm, track, track);
+        return std::unique_ptr<Fluxmap>(new Fluxmap(bits_to_flux(w.bits,
+            [&](size_t position, unsigned cells) { return cells*ticksPerCell; })));
+    }
+
+private:
+    bool _isMfm;
+};
+
+/*
+ * Trial decodes MFM and FM disks. The tracks' sectors are numbered from 1,
+ * so reading them from 0 finds as many good sectors but leaves a hole.
+ */
+static void test_trial_decode(void)
+{
+    MfmBitmapDecoder mfmDecoder;
+    FmBitmapDecoder fmDecoder;
+    IbmRecordParser mfmParser0(IBM_SCHEME_MFM, 0);
+    IbmRecordParser mfmParser1(IBM_SCHEME_MFM, 1);
+    IbmRecordParser fmParser0(IBM_SCHEME_FM, 0);
+    IbmRecordParser fmParser1(IBM_SCHEME_FM, 1);
+    std::vector<ReadCandidate> candidates =
+    {
+        { "MFM from sector 0", mfmDecoder, mfmParser0 },
+        { "MFM from sector 1", mfmDecoder, mfmParser1 },
+        { "FM from sector 0",  fmDecoder,  fmParser0 },
+        { "FM from sector 1",  fmDecoder,  fmParser1 },
+    };
+
+    char name[] = "/tmp/trial-test-XXXXXX";
+    int fd = mkstemp(name);
+    assert(fd != -1);
+    close(fd);
+
+    for (bool isMfm : { true, false })
+    {
+        std::shared_ptr<FluxReader> fluxReader(new SyntheticFluxReader(isMfm));
+        std::vector<std::unique_ptr<Track>> tracks;
+        for (int track=0; track<2; track++)
+            tracks.push_back(std::unique_ptr<Track>(new Track(fluxReader, track, 0)));
+
+        unsigned best = readDiskTrialCommand(tracks, candidates, name);
+        assert(best == (isMfm ? 1 : 3));
+    }
+
+    /* A candidate which fails takes the whole trial down on this thread. */
+    class FailingRecordParser : public RecordParser
+    {
+    public:
+        std::vector<std::unique_ptr<Sector>> parseRecordsToSectors(
+            const RecordVector& records) const
+        {
+            throw std::runtime_error("parser failed");
+        }
+    };
+    FailingRecordParser failingParser;
+    candidates.push_back({ "Failing", mfmDecoder, failingParser });
+
+    std::shared_ptr<FluxReader> fluxReader(new SyntheticFluxReader(true));
+    std::vector<std::unique_ptr<Track>> tracks;
+    for (int track=0; track<8; track++)
+        tracks.push_back(std::unique_ptr<Track>(new Track(fluxReader, track, 0)));
+
+    bool thrown = false;
+    try
+    {
+        readDiskTrialCommand(tracks, candidates, name);
+    }
+    catch (const std::runtime_error& e)
+    {
+        thrown = (std::string(e.what()) == "parser failed");
+    }
+    assert(thrown);
+
+    /* So does a decoder thread in a pipelined read. */
+    Flag* decodeThreads = Flag::find("--decode-threads");
+    std::string saved = decodeThreads->valueAsString();
+    decodeThreads->set("2");
+    thrown = false;
+    try
+    {
+        readDiskCommand(tracks, mfmDecoder, failingParser, name);
+    }
+    catch (const std::runtime_error& e)
+    {
+        thrown = (std::string(e.what()) == "parser failed");
+    }
+    assert(thrown);
+    decodeThreads->set(saved);
+    unlink(name);
+}
+
+/*
+ * Encodes a few tracks of each kind as flux and checks that the encoding
+ * and bit rate are recognised.
+ */
+static void test_encoding_detection(void)
+{
+    struct Case
+    {
+        int encoding;
+        nanoseconds_t clockPeriod;
+    };
+    for (const Case& c : std::vector<Case>{
+            { ENCODING_MFM, 1000 }, { ENCODING_MFM, 2000 },
+            { ENCODING_FM, 2000 }, { ENCODING_FM, 4000 },
+            { ENCODING_BROTHER, 3830 } })
+    {
+        BitWriter w;
+        for (int track=0; track<2; track++)
+        {
+            if (c.encoding == ENCODING_BROTHER)
+                write_brother_track(w, track, track);
+            else
+                write_ibm_track(w, c.encoding == ENCODING_MFM, track, track);
+        }
+
+        Fluxmap fluxmap;
+        fluxmap.appendBits(w.bits, c.clockPeriod);
+        auto guesses = guessEncodings(fluxmap);
+        assert(guesses.size() == 3);
+        assert(guesses[0].encoding == c.encoding);
+        assert(guesses[0].score > 0.85);
+        assert(guesses[1].score < 0.7);
+        assert(abs(guesses[0].clockPeriod - c.clockPeriod) < (c.clockPeriod/20));
+    }
+}
+
+/*
+ * Makes jittery MFM-like flux whose clock falls between two ticks, and
+ * checks that the clock is found to a fraction of a tick, however long the
+ * flux is.
+ */
+static void test_clock_guess(void)
+{
+    const double cellTicks = 12.2;
+    for (int length : { 5000, 75000, 300000 })
+    {
+        Fluxmap fluxmap;
+        uint32_t seed = length;
+        for (int i=0; i<length; i++)
+        {
+            seed = seed*1103515245 + 12345;
+            int cells = 2 + ((seed >> 16) % 3);
+            double jitter = (double)((seed >> 8) & 0xff) / 256.0
+                + (double)(seed & 0xff) / 256.0 - 1.0;
+            fluxmap.appendInterval(lround(cells*cellTicks + jitter*1.5));
+        }
+
+        double clockTicks = (double)fluxmap.guessClock() / NS_PER_TICK;
+        assert(fabs(clockTicks - 2*cellTicks) < 0.2);
+
+        auto peaks = findFluxPeaks(fluxmap);
+        assert(peaks.size() == 3);
+        for (int i=0; i<3; i++)
+            assert(fabs(peaks[i].ticks - (i+2)*cellTicks) < 0.2);
+    }
+}
+
+/*
+ * Makes flux for a track whose speed drifts steadily by 30% from one end
+ * to the other, which is too much for a single clock, and checks that
+ * every sector is still read.
+ */
+static void test_clock_drift(void)
+{
+    const nanoseconds_t clockPeriod = 1000;
+    const double ticksPerCell = clockPeriod / NS_PER_TICK;
+
+    MfmBitmapDecoder decoder;
+    IbmRecordParser parser(IBM_SCHEME_MFM, 1);
+    BitWriter w;
+    write_ibm_track(w, true, 0, 0);
+
+    Fluxmap fluxmap = bits_to_flux(w.bits,
+        [&](size_t position, unsigned cells)
+        {
+            double speed = 0.85 + 0.3*position/w.bits.size();
+            return lround(cells*ticksPerCell*speed);
+        });
+
+    auto good_sectors = [&]()
+    {
+        int good = 0;
+        auto records = decoder.decodeFluxToRecords(fluxmap, clockPeriod);
+        for (const auto& sector : parser.parseRecordsToSectors(records))
+            good += (sector->status == Sector::OK);
+        return good;
+    };
+
+    assert(good_sectors() == 9);
+
+    Flag* zoneSize = Flag::find("--clock-zone-size");
+    std::string saved = zoneSize->valueAsString();
+    zoneSize->set("0");
+    assert(good_sectors() < 9);
+    zoneSize->set(saved);
+}
+
+/*
+ * Makes jittery flux for a track whose speed drifts, with the odd glitch
+ * pulse a few ticks after a real one, and checks that the PLL reads every
+ * sector.
+ */
+static void test_pll(void)
+{
+    const nanoseconds_t clockPeriod = 1000;
+    const double ticksPerCell = clockPeriod / NS_PER_TICK;
+
+    MfmBitmapDecoder decoder;
+    IbmRecordParser parser(IBM_SCHEME_MFM, 1);
+    BitWriter w;
+    write_ibm_track(w, true, 0, 0);
+
+    uint32_t seed = 0;
+    Fluxmap clean = bits_to_flux(w.bits,
+        [&](size_t position, unsigned cells)
+        {
+            seed = seed*1103515245 + 12345;
+            int jitter = (int)((seed >> 16) % 5) - 2;
+            double speed = 0.93 + 0.14*position/w.bits.size();
+            return lround(cells*ticksPerCell*speed) + jitter;
+        });
+
+    Fluxmap fluxmap;
+    for (int i=0; i<clean.size(); i++)
+    {
+        if ((i % 1000) == 500)
+            fluxmap.appendInterval(3).appendInterval(clean[i] - 3);
+        else
+            fluxmap.appendInterval(clean[i]);
+    }
+
+    auto bits = fluxmap.decodeToBitsWithPll(clockPeriod, 0.65, 0.04, 0.8);
+    auto sectors = parser.parseRecordsToSectors(decoder.decodeBitsToRecords(bits));
+    assert(sectors.size() == 9);
+    for (const auto& sector : sectors)
+        assert(sector->status == Sector::OK);
+}
+
+int main(int argc, const char* argv[])
+{
+    MfmBitmapDecoder mfmDecoder;
+    FmBitmapDecoder fmDecoder;
+    BrotherBitmapDecoder brotherDecoder;
+    IbmRecordParser mfmParser(IBM_SCHEME_MFM, 1);
+    IbmRecordParser fmParser(IBM_SCHEME_FM, 1);
+    BrotherRecordParser brotherParser;
+
+    std::vector<TestTrack> tracks(TRACKS);
+    for (int i=0; i<TRACKS; i++)
+    {
+        BitWriter w;
+        switch (i % 3)
+        {
+            case 0:
+                write_ibm_track(w, true, i, i);
+                tracks[i] = { &mfmDecoder, &mfmParser, w.bits };
+                break;
+
+            case 1:
+                write_ibm_track(w, false, i, i);
+                tracks[i] = { &fmDecoder, &fmParser, w.bits };
+                break;
+
+            case 2:
+                write_brother_track(w, i, i);
+                tracks[i] = { &brotherDecoder, &brotherParser, w.bits };
+                break;
+        }
+    }
+
+    std::vector<std::string> expected;
+    for (const auto& track : tracks)
+        expected.push_back(decode(track));
+
+    std::vector<int> failures(THREADS);
+    std::vector<std::thread> threads;
+    for (int t=0; t<THREADS; t++)
+    {
+        threads.push_back(std::thread(
+            [&, t]()
+            {
+                for (int pass=0; pass<PASSES; pass++)
+                {
+                    for (int i=0; i<TRACKS; i++)
+                    {
+                        int index = (i + t*5) % TRACKS;
+                        if (decode(tracks[index]) != expected[index])
+                            failures[t]++;
+                    }
+                }
+            }
+        ));
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    for (int f : failures)
+        assert(f == 0);
+
+    test_flux_decoding();
+    test_long_track();
+    test_trial_decode();
+    test_encoding_detection();
+    test_clock_guess();
+    test_clock_drift();
+    test_pll();
+    test_bit_repair();
+    return 0;
+}
@@ -15,9 +15,22 @@ static void testDefaultIntValue()
     assert(intFlag.value == 2);
 }
 
+static void testFind()
+{
+    Flag* flag = Flag::find("--intFlag");
+    assert(flag == &intFlag);
+    assert(Flag::find("--noSuchFlag") == NULL);
+
+    flag->set("7");
+    assert(flag->valueAsString() == "7");
+    flag->set(flag->defaultValueAsString());
+    assert(intFlag.value == intFlag.defaultValue);
+}
+
 int main(int argc, const char* argv[])
 {
     testDefaultIntValue();
+    testFind();
     return 0;
 }
 
@@ -0,0 +1,161 @@
+#include "globals.h"
+#include "fluxmap.h"
+#include "protocol.h"
+#include <assert.h>
+#include <limits>
+
+static void test_ticks(void)
+{
+    Fluxmap fluxmap;
+    fluxmap.appendIntervals({ 10, 0, 20 });
+    assert(fluxmap.size() == 3);
+    assert(fluxmap.ticks() == (10 + 0xffff + 20));
+    assert(fluxmap.duration() == (nanoseconds_t)((10 + 0xffff + 20) * NS_PER_TICK));
+
+    fluxmap.appendInterval(0x20000);
+    assert(fluxmap.size() == 6);
+    assert((fluxmap[3] == 0) && (fluxmap[4] == 0) && (fluxmap[5] == 2));
+    assert(fluxmap.ticks() == (10 + 0xffff + 20 + 0x20000));
+}
+
+static void test_bytes(void)
+{
+    /* A zero byte adds to the next interval, even in the next call. */
+    Fluxmap fluxmap;
+    fluxmap.appendBytes({ 10, 0, 20, 0, 0 });
+    fluxmap.appendBytes({ 30, 40 });
+    assert(fluxmap.size() == 4);
+    assert((fluxmap[0] == 10) && (fluxmap[1] == 276) && (fluxmap[2] == 542) && (fluxmap[3] == 40));
+    assert(fluxmap.ticks() == 868);
+
+    fluxmap.addIndexMark(2);
+    std::vector<size_t> positions;
+    std::vector<uint8_t> bytes = fluxmap.toBytes(&positions);
+    assert(bytes == std::vector<uint8_t>({ 10, 0, 20, 0, 0, 30, 40 }));
+    assert(positions == std::vector<size_t>({ 3 }));
+
+    /* Index marks come back to the same intervals. */
+    Fluxmap copy;
+    copy.appendBytes(bytes.data(), bytes.size(), positions);
+    assert(copy.size() == 4);
+    assert(copy.indexPosition(0) == 2);
+    assert(copy.indexTime(0) == fluxmap.indexTime(0));
+
+    /* Exact multiples of 0x100 can't be written, so they move a tick. */
+    Fluxmap round;
+    round.appendIntervals({ 0x200, 10 });
+    assert(round.toBytes() == std::vector<uint8_t>({ 0, 0xff, 11 }));
+
+    Fluxmap gap;
+    gap.appendIntervals({ 0, 20 });
+    bytes = gap.toBytes();
+    assert(bytes.size() == 257);
+    assert(bytes[255] == 0);
+    assert(bytes[256] == 19);
+}
+
+static void test_tick_sum(void)
+{
+    /* Odd lengths and offsets, so every part of the summing gets used. */
+    std::vector<uint16_t> intervals;
+    for (int i=0; i<1000; i++)
+        intervals.push_back(i*337);
+
+    for (size_t start=0; start<20; start++)
+    {
+        Fluxmap fluxmap;
+        fluxmap.appendIntervals(&intervals[start], intervals.size() - start - 3);
+
+        uint64_t ticks = 0;
+        for (int i=0; i<fluxmap.size(); i++)
+            ticks += fluxmap[i] ? fluxmap[i] : 0xffff;
+        assert(fluxmap.ticks() == ticks);
+    }
+}
+
+static void test_long_capture(void)
+{
+    /* More ticks than fit in 32 bits. */
+    const size_t count = 100000;
+    Fluxmap fluxmap;
+    fluxmap.appendIntervals(std::vector<uint16_t>(count, 0xfffe));
+    fluxmap.appendInterval(0xffff);
+    assert(fluxmap.ticks() == ((uint64_t)count * 0xfffe) + 0xffff);
+    assert(fluxmap.duration() == std::numeric_limits<nanoseconds_t>::max());
+
+    fluxmap.addIndexMark();
+    Fluxmap tail = fluxmap.slice(count - 1, count + 1);
+    assert(tail.ticks() == 0xfffe + 0xffff);
+}
+
+static void test_time_index(void)
+{
+    std::vector<uint16_t> intervals;
+    for (int i=0; i<1000; i++)
+        intervals.push_back(1 + i*13);
+    Fluxmap fluxmap;
+    fluxmap.appendIntervals(intervals);
+
+    uint64_t ticks = 0;
+    for (int i=0; i<fluxmap.size(); i++)
+    {
+        assert(fluxmap.ticksAt(i) == ticks);
+        assert(fluxmap.indexAt(ticks) == (size_t)((i == 0) ? 0 : (i-1)));
+        assert(fluxmap.indexAt(ticks + 1) == (size_t)i);
+        ticks += fluxmap[i];
+    }
+    assert(fluxmap.ticksAt(fluxmap.size()) == ticks);
+    assert(fluxmap.indexAt(ticks + 1) == (size_t)fluxmap.size());
+
+    /* Appending throws the index away. */
+    fluxmap.appendInterval(7);
+    assert(fluxmap.ticksAt(fluxmap.size() - 1) == ticks);
+    assert(fluxmap.indexAt(ticks + 7) == (size_t)(fluxmap.size() - 1));
+}
+
+static void test_revolutions(void)
+{
+    Fluxmap fluxmap;
+    fluxmap.addIndexMark();
+    fluxmap.appendIntervals({ 1, 2, 3 });
+    fluxmap.addIndexMark();
+    fluxmap.appendIntervals({ 4, 5 });
+    fluxmap.addIndexMark();
+    assert(fluxmap.revolutions() == 2);
+    assert(fluxmap.indexPosition(1) == 3);
+    assert(fluxmap.indexTime(2) == (nanoseconds_t)(15 * NS_PER_TICK));
+
+    Fluxmap second = fluxmap.revolution(1);
+    assert(second.size() == 2);
+    assert(second.ptr() == fluxmap.ptr() + 3);
+    assert((second[0] == 4) && (second[1] == 5));
+    assert(second.duration() == (nanoseconds_t)(9 * NS_PER_TICK));
+    assert(second.revolutions() == 1);
+    assert(second.indexPosition(0) == 0);
+    assert(second.indexTime(1) == (nanoseconds_t)(9 * NS_PER_TICK));
+}
+
+static void test_copy_on_write(void)
+{
+    Fluxmap fluxmap;
+    fluxmap.appendIntervals({ 1, 2, 3, 4 });
+    Fluxmap slice = fluxmap.slice(1, 3);
+
+    slice.appendInterval(9);
+    assert(slice.size() == 3);
+    assert(slice[2] == 9);
+    assert(fluxmap.size() == 4);
+    assert(fluxmap[3] == 4);
+}
+
+int main(int argc, const char* argv[])
+{
+    test_ticks();
+    test_bytes();
+    test_tick_sum();
+    test_long_capture();
+    test_time_index();
+    test_revolutions();
+    test_copy_on_write();
+    return 0;
+}
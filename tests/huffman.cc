@@ -0,0 +1,60 @@
+#include "globals.h"
+#include "huffman.h"
+#include <assert.h>
+
+static void roundtrip(const std::vector<uint8_t>& data)
+{
+    auto compressed = huffmanCompress(data.data(), data.size());
+    auto decompressed = huffmanDecompress(compressed.data(), compressed.size());
+    assert(decompressed == data);
+}
+
+static void test_empty(void)
+{
+    roundtrip({});
+}
+
+static void test_one_symbol(void)
+{
+    roundtrip({ 42 });
+    roundtrip(std::vector<uint8_t>(1001, 7));
+}
+
+static void test_flux(void)
+{
+    /* Intervals scattered around three clock peaks, plus some overflows. */
+    std::vector<uint8_t> data;
+    uint32_t seed = 1;
+    for (int i=0; i<100000; i++)
+    {
+        seed = seed*1103515245 + 12345;
+        unsigned r = seed >> 16;
+        if ((r % 1000) == 0)
+            data.push_back(0);
+        else
+            data.push_back(24*(1 + r%3) + (int)((r >> 4) % 5) - 2);
+    }
+
+    auto compressed = huffmanCompress(data.data(), data.size());
+    assert(compressed.size() < (data.size()*6/10));
+    roundtrip(data);
+}
+
+static void test_all_symbols(void)
+{
+    /* Skewed enough that the codes would be too long without limiting. */
+    std::vector<uint8_t> data;
+    for (int i=0; i<256; i++)
+        for (int j=0; j<(1 << (i/16)); j++)
+            data.push_back(i);
+    roundtrip(data);
+}
+
+int main(int argc, const char* argv[])
+{
+    test_empty();
+    test_one_symbol();
+    test_flux();
+    test_all_symbols();
+    return 0;
+}
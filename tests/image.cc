@@ -0,0 +1,105 @@
+#include "globals.h"
+#include "image.h"
+#include "sector.h"
+#include "sectorset.h"
+#include "testsectors.h"
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+
+static std::string filename;
+
+static std::vector<uint8_t> read_file(void)
+{
+    std::vector<uint8_t> data;
+    FILE* fp = fopen(filename.c_str(), "rb");
+    assert(fp);
+    int c;
+    while ((c = fgetc(fp)) != EOF)
+        data.push_back(c);
+    fclose(fp);
+    return data;
+}
+
+/* Tracks handed over out of order still come out in order. */
+static void test_streaming(void)
+{
+    SectorSet sectors;
+    for (int track=0; track<4; track++)
+        for (int head=0; head<2; head++)
+            for (int sector=0; sector<3; sector++)
+                if ((track != 2) || (sector != 1))
+                    put(sectors, track, head, sector, 16);
+
+    Geometry geometry = { 5, 2, 0, 0 };
+    ImageWriter writer(filename, geometry);
+    writer.writeTrack(sectors, 1, 0);
+    writer.writeTrack(sectors, 0, 1);
+    writer.writeTrack(sectors, 1, 1);
+    assert(read_file().empty());
+
+    writer.writeTrack(sectors, 0, 0);
+    assert(writer.geometry().sectors == 3);
+    assert(writer.geometry().sectorSize == 16);
+    assert(read_file().size() == (2*2*3*16));
+
+    writer.writeTrack(sectors, 3, 0);
+    writer.writeTrack(sectors, 3, 1);
+    writer.writeTrack(sectors, 2, 1);
+    writer.writeTrack(sectors, 2, 0);
+    writer.close();
+
+    auto data = read_file();
+    assert(data.size() == (5*2*3*16));
+    for (int track=0; track<5; track++)
+        for (int head=0; head<2; head++)
+            for (int sector=0; sector<3; sector++)
+            {
+                size_t offset = ((track*2 + head)*3 + sector)*16;
+                bool present = (track < 4) && ((track != 2) || (sector != 1));
+                uint8_t expected = present ? sector_fill(track, head, sector) : 0;
+                for (int i=0; i<16; i++)
+                    assert(data[offset + i] == expected);
+            }
+}
+
+static void test_roundtrip(void)
+{
+    SectorSet sectors;
+    for (int track=0; track<3; track++)
+        for (int head=0; head<2; head++)
+            for (int sector=0; sector<3; sector++)
+                put(sectors, track, head, sector, 16);
+
+    Geometry geometry = guessGeometry(sectors);
+    writeSectorsToFile(sectors, geometry, filename);
+
+    /* One more track than the file holds, which should read as zeroes. */
+    geometry.tracks++;
+    SectorSet readBack;
+    readSectorsFromFile(readBack, geometry, filename);
+    const SectorSet& s = readBack;
+    for (int track=0; track<4; track++)
+        for (int head=0; head<2; head++)
+            for (int sector=0; sector<3; sector++)
+            {
+                Sector* p = s.get(track, head, sector);
+                assert(p);
+                uint8_t expected = (track < 3) ? sector_fill(track, head, sector) : 0;
+                assert(p->data == std::vector<uint8_t>(16, expected));
+            }
+}
+
+int main(int argc, const char* argv[])
+{
+    char name[] = "/tmp/image-test-XXXXXX";
+    int fd = mkstemp(name);
+    assert(fd != -1);
+    close(fd);
+    filename = name;
+
+    test_streaming();
+    test_roundtrip();
+    unlink(name);
+    return 0;
+}
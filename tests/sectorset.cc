@@ -0,0 +1,83 @@
+#include "globals.h"
+#include "sector.h"
+#include "sectorset.h"
+#include "testsectors.h"
+#include <assert.h>
+
+static void test_dense(void)
+{
+    SectorSet sectors;
+    for (int track=79; track>=0; track--)
+        for (int head=0; head<2; head++)
+            for (int sector=0; sector<18; sector++)
+                put(sectors, track, head, sector);
+
+    const SectorSet& s = sectors;
+    for (int track=0; track<80; track++)
+        for (int head=0; head<2; head++)
+            for (int sector=0; sector<18; sector++)
+            {
+                Sector* p = s.get(track, head, sector);
+                assert(p);
+                assert((p->track == track) && (p->side == head) && (p->sector == sector));
+            }
+    assert(!s.get(0, 0, 18));
+    assert(!s.get(80, 0, 0));
+    assert(!s.get(5, 1, 200));
+
+    int tracks, heads, sectorsPerTrack, sectorSize;
+    s.calculateSize(tracks, heads, sectorsPerTrack, sectorSize);
+    assert(tracks == 80);
+    assert(heads == 2);
+    assert(sectorsPerTrack == 18);
+    assert(sectorSize == 256);
+}
+
+static void test_sparse(void)
+{
+    SectorSet sectors;
+    put(sectors, 0, 0, -1, 128);
+    put(sectors, 0, 3, 0);
+    put(sectors, 1000, 0, 0);
+    put(sectors, 2, 0, 5000, 512);
+    put(sectors, 1, 1, 1);
+
+    const SectorSet& s = sectors;
+    assert(s.get(0, 0, -1)->data.size() == 128);
+    assert(s.get(0, 3, 0)->side == 3);
+    assert(s.get(1000, 0, 0)->track == 1000);
+    assert(s.get(2, 0, 5000)->sector == 5000);
+    assert(s.get(1, 1, 1));
+    assert(!s.get(0, 0, -2));
+    assert(!s.get(1, 0, 1));
+
+    int tracks, heads, sectorsPerTrack, sectorSize;
+    s.calculateSize(tracks, heads, sectorsPerTrack, sectorSize);
+    assert(tracks == 1001);
+    assert(heads == 4);
+    assert(sectorsPerTrack == 5001);
+    assert(sectorSize == 512);
+}
+
+static void test_replace(void)
+{
+    SectorSet sectors;
+    put(sectors, 3, 0, 2, 10);
+    put(sectors, 3, 0, 2, 20);
+    const SectorSet& s = sectors;
+    assert(s.get(3, 0, 2)->data.size() == 20);
+
+    sectors.get(3, 0, 2).reset();
+    assert(!s.get(3, 0, 2));
+    int tracks, heads, sectorsPerTrack, sectorSize;
+    s.calculateSize(tracks, heads, sectorsPerTrack, sectorSize);
+    assert(tracks == 0);
+}
+
+int main(int argc, const char* argv[])
+{
+    test_dense();
+    test_sparse();
+    test_replace();
+    return 0;
+}
@@ -0,0 +1,177 @@
+#include "globals.h"
+#include "flags.h"
+#include "usb.h"
+#include "protocol.h"
+#include "fluxmap.h"
+#include "decoders.h"
+#include "record.h"
+#include "sector.h"
+#include "sql.h"
+#include <assert.h>
+#include <unistd.h>
+
+#define MS(ms) ((uint64_t)(ms) * TICKS_PER_MS)
+
+static std::string filename;
+static uint8_t buffer[FRAME_SIZE];
+
+static const any_frame& receive(FluxEngineDevice& device)
+{
+    device.receiveReply(buffer, sizeof(buffer));
+    return *(const any_frame*) buffer;
+}
+
+static void seek(FluxEngineDevice& device, int track)
+{
+    seek_frame f = { { F_FRAME_SEEK_CMD, sizeof(f) }, (uint8_t) track };
+    device.sendCommand(&f, sizeof(f));
+    assert(receive(device).f.type == F_FRAME_SEEK_REPLY);
+}
+
+static std::unique_ptr<Fluxmap> read(FluxEngineDevice& device, int side, int revolutions)
+{
+    read_frame f = { { F_FRAME_READ_CMD, sizeof(f) }, (uint8_t) side, (uint8_t) revolutions };
+    device.sendCommand(&f, sizeof(f));
+
+    std::unique_ptr<Fluxmap> fluxmap(new Fluxmap);
+    device.receiveStream(
+        [&](const uint8_t* data, size_t len)
+        {
+            fluxmap->appendBytes(data, len);
+        }
+    );
+    assert(receive(device).f.type == F_FRAME_READ_REPLY);
+    return fluxmap;
+}
+
+/* Every sector of the synthetic disk is good, and filled with a pattern. */
+static void check_track(const Fluxmap& fluxmap, int track, int side)
+{
+    MfmBitmapDecoder decoder;
+    IbmRecordParser parser(IBM_SCHEME_MFM, 1);
+    auto records = decoder.decodeFluxToRecords(fluxmap, decoder.guessClock(fluxmap));
+    auto sectors = parser.parseRecordsToSectors(records);
+    assert(sectors.size() == 18);
+    for (const auto& sector : sectors)
+    {
+        assert(sector->status == Sector::OK);
+        assert((sector->track == track) && (sector->side == side));
+        assert(sector->data.size() == 512);
+        for (int i=0; i<512; i++)
+            assert(sector->data[i] == (uint8_t)(track*7 + side*3 + sector->sector + i));
+    }
+}
+
+/*
+ * Follows the simulated clock through a few commands: the motor spins up
+ * and the head is homed from track 40 before the first seek, and reads
+ * start at the index hole.
+ */
+static void test_timing(void)
+{
+    auto device = createSimulatedFluxEngine("synthetic");
+    assert(simulatedFluxEngineTime(*device) == 0);
+
+    seek(*device, 10);
+    assert(simulatedFluxEngineTime(*device) == MS(1000 + 41*7 + 1 + 10*7 + 40));
+    seek(*device, 12);
+    assert(simulatedFluxEngineTime(*device) == MS(1398 + 2*7 + 40));
+
+    any_frame f = { { F_FRAME_MEASURE_SPEED_CMD, sizeof(f) } };
+    device->sendCommand(&f, sizeof(f));
+    const auto& speed = (const speed_frame&) receive(*device);
+    assert(speed.f.type == F_FRAME_MEASURE_SPEED_REPLY);
+    assert(speed.period_ms == 200);
+    assert(simulatedFluxEngineTime(*device) == MS(1600 + 200));
+
+    check_track(*read(*device, 0, 1), 12, 0);
+    assert(simulatedFluxEngineTime(*device) == MS(2000 + 200));
+    read(*device, 1, 2);
+    assert(simulatedFluxEngineTime(*device) == MS(2400 + 2*200));
+
+    f = { { F_FRAME_RECALIBRATE_CMD, sizeof(f) } };
+    device->sendCommand(&f, sizeof(f));
+    assert(receive(*device).f.type == F_FRAME_RECALIBRATE_REPLY);
+    assert(simulatedFluxEngineTime(*device) == MS(2800 + 13*7 + 1 + 40));
+}
+
+/* Malformed commands get error frames, as from the firmware. */
+static void test_errors(void)
+{
+    auto device = createSimulatedFluxEngine("synthetic");
+    auto error = [&]()
+    {
+        const auto& r = (const error_frame&) receive(*device);
+        assert(r.f.type == F_FRAME_ERROR);
+        return r.error;
+    };
+
+    any_frame f = { { F_FRAME_GET_VERSION_CMD, sizeof(f) + 1 } };
+    device->sendCommand(&f, sizeof(f));
+    assert(error() == F_ERROR_BAD_COMMAND);
+
+    f = { { 0xff, sizeof(f) } };
+    device->sendCommand(&f, sizeof(f));
+    assert(error() == F_ERROR_BAD_COMMAND);
+
+    write_frame w = { { F_FRAME_WRITE_CMD, sizeof(w) }, 0, FRAME_SIZE + 1 };
+    device->sendCommand(&w, sizeof(w));
+    assert(error() == F_ERROR_INVALID_VALUE);
+}
+
+/*
+ * Copies a few tracks of the synthetic disk into a flux file, serves that
+ * through the ordinary USB calls, and writes one track over another.
+ */
+static void test_flux_file(void)
+{
+    std::vector<std::unique_ptr<Fluxmap>> tracks;
+    {
+        auto device = createSimulatedFluxEngine("synthetic");
+        unlink(filename.c_str());
+        SqlFluxStore store(filename, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+        for (int track=0; track<3; track++)
+        {
+            seek(*device, track);
+            for (int side=0; side<2; side++)
+            {
+                auto fluxmap = read(*device, side, 1);
+                check_track(*fluxmap, track, side);
+                store.writeFlux(track, side, *fluxmap);
+                tracks.push_back(std::move(fluxmap));
+            }
+        }
+    }
+
+    Flag::find("--simulate")->set(filename);
+    assert(usbGetVersion() == FLUXENGINE_VERSION);
+    assert(usbGetRotationalPeriod() == 200*1000);
+
+    usbSeek(1);
+    check_track(*usbRead(1, 1), 1, 1);
+
+    usbSeek(0);
+    usbWrite(0, *tracks[2*2 + 0]);
+    check_track(*usbRead(0, 1), 2, 0);
+    check_track(*usbRead(1, 1), 0, 1);
+
+    usbSeek(2);
+    check_track(*usbRead(0, 1), 2, 0);
+}
+
+int main(int argc, const char* argv[])
+{
+    Flag::find("--simulated-time-scale")->set("0");
+
+    char name[] = "/tmp/simulator-test-XXXXXX";
+    int fd = mkstemp(name);
+    assert(fd != -1);
+    close(fd);
+    filename = name;
+
+    test_timing();
+    test_errors();
+    test_flux_file();
+    unlink(name);
+    return 0;
+}
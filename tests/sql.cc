@@ -0,0 +1,87 @@
+#include "globals.h"
+#include "fluxmap.h"
+#include "sql.h"
+#include <assert.h>
+#include <unistd.h>
+
+static std::string filename;
+
+/* A few revolutions, with a gap long enough to need a continuation. */
+static Fluxmap make_flux(void)
+{
+    Fluxmap fluxmap;
+    for (int revolution=0; revolution<3; revolution++)
+    {
+        fluxmap.addIndexMark();
+        for (int i=0; i<1000; i++)
+            fluxmap.appendInterval(20 + (i*7 + revolution) % 50);
+        if (revolution == 1)
+            fluxmap.appendInterval(70000);
+    }
+    fluxmap.addIndexMark();
+    return fluxmap;
+}
+
+static std::unique_ptr<Fluxmap> roundtrip(const Fluxmap& fluxmap)
+{
+    unlink(filename.c_str());
+    {
+        SqlFluxStore store(filename, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+        store.writeFlux(0, 0, fluxmap);
+    }
+
+    SqlFluxStore store(filename, SQLITE_OPEN_READONLY);
+    return store.readFlux(0, 0);
+}
+
+static void test_index_marks(void)
+{
+    Fluxmap fluxmap = make_flux();
+    auto readBack = roundtrip(fluxmap);
+
+    assert(readBack->size() == fluxmap.size());
+    assert(readBack->ticks() == fluxmap.ticks());
+    assert(readBack->indexMarks() == 4);
+    for (unsigned i=0; i<4; i++)
+    {
+        assert(readBack->indexPosition(i) == fluxmap.indexPosition(i));
+        assert(readBack->indexTime(i) == fluxmap.indexTime(i));
+    }
+}
+
+/* Marks which were only guessed at are used, but never saved. */
+static void test_estimated_marks(void)
+{
+    Fluxmap fluxmap;
+    fluxmap.addIndexMark();
+    for (int i=0; i<3000; i++)
+    {
+        if (i && !(i % 1000))
+            fluxmap.addIndexMark(fluxmap.size(), true);
+        fluxmap.appendInterval(20 + i%50);
+    }
+    fluxmap.addIndexMark();
+    assert(fluxmap.revolutions() == 3);
+    assert(!fluxmap.indexEstimated(0) && fluxmap.indexEstimated(1));
+
+    auto readBack = roundtrip(fluxmap);
+    assert(readBack->size() == fluxmap.size());
+    assert(readBack->indexMarks() == 2);
+    assert(readBack->indexPosition(0) == 0);
+    assert(readBack->indexPosition(1) == (size_t)fluxmap.size());
+    assert(!readBack->indexEstimated(1));
+}
+
+int main(int argc, const char* argv[])
+{
+    char name[] = "/tmp/sql-test-XXXXXX";
+    int fd = mkstemp(name);
+    assert(fd != -1);
+    close(fd);
+    filename = name;
+
+    test_index_marks();
+    test_estimated_marks();
+    unlink(name);
+    return 0;
+}
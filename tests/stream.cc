@@ -0,0 +1,127 @@
+#include "globals.h"
+#include "fluxmap.h"
+#include "stream.h"
+#include "protocol.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* Stream files are named after their track; this is the prefix. */
+static std::string path;
+
+#define SCLK_HZ 24027428.57142857
+
+static unsigned ticks(uint32_t sclk)
+{
+    return (unsigned)((double)sclk * TICK_FREQUENCY / SCLK_HZ);
+}
+
+static std::unique_ptr<Fluxmap> read_stream(const std::vector<uint8_t>& stream)
+{
+    std::string filename = path + "00.0.raw";
+    FILE* fp = fopen(filename.c_str(), "wb");
+    assert(fp);
+    fwrite(stream.data(), 1, stream.size(), fp);
+    fclose(fp);
+
+    auto fluxmap = readStream(path, 0, 0);
+    unlink(filename.c_str());
+    return fluxmap;
+}
+
+/* An index OOB block at the given stream position. */
+static void add_index(std::vector<uint8_t>& stream, uint32_t position)
+{
+    std::vector<uint8_t> block = { 0x0d, 0x02, 12, 0,
+        (uint8_t)position, (uint8_t)(position >> 8),
+        (uint8_t)(position >> 16), (uint8_t)(position >> 24),
+        0, 0, 0, 0, 0, 0, 0, 0 };
+    stream.insert(stream.end(), block.begin(), block.end());
+}
+
+static void add_eof(std::vector<uint8_t>& stream)
+{
+    std::vector<uint8_t> block = { 0x0d, 0x0d, 0x0d, 0x0d };
+    stream.insert(stream.end(), block.begin(), block.end());
+}
+
+/*
+ * Index blocks give a position in the stream, not counting OOB blocks,
+ * which has to be turned into an interval; a Flux2 takes two bytes for one
+ * interval, so moves the two apart.
+ */
+static void test_index(void)
+{
+    std::vector<uint8_t> stream = {
+        0x20, 0x21, 0x22,   /* intervals 0-2, at stream positions 0-2 */
+        0x01, 0x00,         /* interval 3, at 3-4 */
+        0x30,               /* interval 4, at 5 */
+    };
+    add_index(stream, 5);
+    stream.push_back(0x40); /* interval 5, at 6 */
+    add_index(stream, 6);
+    stream.push_back(0x50);
+    add_eof(stream);
+
+    auto fluxmap = read_stream(stream);
+    assert(fluxmap->size() == 7);
+    assert((*fluxmap)[3] == ticks(0x100));
+    assert((*fluxmap)[4] == ticks(0x30));
+    assert(fluxmap->indexMarks() == 2);
+    assert(fluxmap->indexPosition(0) == 4);
+    assert(fluxmap->indexPosition(1) == 5);
+}
+
+/*
+ * Every kind of flux, plus padding. Ovl16s add up until they pass 0xffff
+ * ticks, when a continuation is written; so a flux never needs more than
+ * one more, even after several.
+ */
+static void test_opcodes(void)
+{
+    std::vector<uint8_t> stream = {
+        0x20,               /* Flux1 */
+        0x05, 0x10,         /* Flux2 */
+        0x0c, 0x12, 0x34,   /* Flux3 */
+        0x08,               /* Nop1 */
+        0x09, 0xaa,         /* Nop2 */
+        0x0a, 0xaa, 0xaa,   /* Nop3 */
+        0x0b, 0x30,         /* Ovl16 and a Flux1 */
+    };
+    add_index(stream, 14);
+    stream.insert(stream.end(), {
+        0x0b, 0x0b, 0x0b, 0x0b,
+        0x07, 0xff,         /* Flux2, after four Ovl16s */
+        0x40,
+    });
+    add_eof(stream);
+
+    auto fluxmap = read_stream(stream);
+    assert(fluxmap->size() == 8);
+    assert((*fluxmap)[0] == ticks(0x20));
+    assert((*fluxmap)[1] == ticks(0x510));
+    assert((*fluxmap)[2] == ticks(0x1234));
+    assert(abs((int)(*fluxmap)[3] - (int)ticks(0x10030)) <= 1);
+    assert((*fluxmap)[4] == 0);
+    assert((*fluxmap)[5] == 0);
+    assert((*fluxmap)[6] != 0);
+    uint64_t longFlux = fluxmap->ticksAt(7) - fluxmap->ticksAt(4);
+    assert(llabs((long long)longFlux - ticks(0x407ff)) <= 2);
+    assert((*fluxmap)[7] == ticks(0x40));
+
+    assert(fluxmap->indexMarks() == 1);
+    assert(fluxmap->indexPosition(0) == 4);
+}
+
+int main(int argc, const char* argv[])
+{
+    char dir[] = "/tmp/stream-test-XXXXXX";
+    assert(mkdtemp(dir));
+    path = std::string(dir) + "/track";
+
+    test_index();
+    test_opcodes();
+    rmdir(dir);
+    return 0;
+}
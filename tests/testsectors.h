@@ -0,0 +1,20 @@
+#ifndef TESTSECTORS_H
+#define TESTSECTORS_H
+
+/*
+ * Stores a good sector of the given size, filled with a byte made from its
+ * location so that tests can tell which sector ended up where.
+ */
+static inline uint8_t sector_fill(int track, int head, int sector)
+{
+    return track*16 + head*8 + sector;
+}
+
+static inline void put(SectorSet& sectors, int track, int head, int sector, size_t size = 256)
+{
+    sectors.get(track, head, sector).reset(
+        new Sector(Sector::OK, track, head, sector,
+            std::vector<uint8_t>(size, sector_fill(track, head, sector))));
+}
+
+#endif
@@ -0,0 +1,127 @@
+#include "globals.h"
+#include "decoders.h"
+#include "sector.h"
+#include "voting.h"
+#include "crc.h"
+#include "record.h"
+#include <assert.h>
+
+static const IbmRecordParser parser(IBM_SCHEME_MFM, 1);
+
+/* The raw bytes of an IBM MFM sector: prologue, DAM, data, CRC. */
+static std::vector<uint8_t> make_raw(void)
+{
+    std::vector<uint8_t> raw = { 0xa1, 0xa1, 0xa1, IBM_DAM1 };
+    for (int i=0; i<512; i++)
+        raw.push_back(i*7);
+    uint16_t crc = crc16(CCITT_POLY, &raw[0], &raw[0] + raw.size());
+    raw.push_back(crc >> 8);
+    raw.push_back(crc);
+    return raw;
+}
+
+static std::unique_ptr<Sector> make_sector(const std::vector<uint8_t>& raw)
+{
+    return std::unique_ptr<Sector>(
+        new Sector(parser.checkRawSector(raw), 0, 0, 0, std::vector<uint8_t>(raw),
+            4, raw.size() - 6));
+}
+
+static std::vector<uint8_t> corrupt(std::vector<uint8_t> raw, size_t position)
+{
+    raw[position] ^= 0x10;
+    return raw;
+}
+
+static void test_good_copy_wins(void)
+{
+    auto raw = make_raw();
+    SectorVoter voter;
+    voter.add(make_sector(corrupt(raw, 10)));
+    voter.add(make_sector(raw));
+    assert(voter.hasGoodCopy());
+
+    auto sector = voter.vote(parser);
+    assert(sector->status == Sector::OK);
+    assert(sector->raw == raw);
+}
+
+static void test_majority(void)
+{
+    auto raw = make_raw();
+    SectorVoter voter;
+    voter.add(make_sector(corrupt(raw, 10)));
+    voter.add(make_sector(corrupt(raw, 200)));
+    voter.add(make_sector(corrupt(raw, 517)));
+    assert(!voter.hasGoodCopy());
+
+    auto sector = voter.vote(parser);
+    assert(sector->status == Sector::OK);
+    assert(sector->raw == raw);
+    assert(sector->data == std::vector<uint8_t>(raw.begin() + 4, raw.end() - 2));
+    assert(sector->copies == 3);
+    assert((sector->confidence > 0.66) && (sector->confidence < 0.67));
+}
+
+static void test_two_copies(void)
+{
+    /* Every difference is a tie, settled by the CRC. */
+    auto raw = make_raw();
+    SectorVoter voter;
+    voter.add(make_sector(corrupt(raw, 10)));
+    voter.add(make_sector(corrupt(corrupt(raw, 300), 301)));
+
+    auto sector = voter.vote(parser);
+    assert(sector->status == Sector::OK);
+    assert(sector->raw == raw);
+    assert(sector->confidence == 0.5);
+}
+
+static void test_unrecoverable(void)
+{
+    auto raw = make_raw();
+    SectorVoter voter;
+    voter.add(make_sector(corrupt(raw, 10)));
+    voter.add(make_sector(corrupt(raw, 10)));
+
+    /* A truncated copy can't be lined up with the others, so doesn't vote. */
+    voter.add(make_sector(std::vector<uint8_t>(raw.begin(), raw.end() - 1)));
+
+    auto sector = voter.vote(parser);
+    assert(sector->status == Sector::BAD_CHECKSUM);
+    assert(sector->copies == 2);
+    assert(sector->confidence == 1.0);
+}
+
+/* A good copy in an arena is passed on without copying its bytes. */
+static void test_shared_bytes(void)
+{
+    auto raw = make_raw();
+    std::unique_ptr<Sector> sector;
+    const uint8_t* bytes;
+    {
+        auto arena = RecordArena::create();
+        ByteSpan span = arena->copy(raw);
+        bytes = span.data();
+        SectorVoter voter;
+        voter.add(std::unique_ptr<Sector>(
+            new Sector(Sector::OK, 0, 0, 0, span, arena, 4, raw.size() - 6)));
+        sector = voter.vote(parser);
+    }
+
+    /* The voter and the arena handle have gone, but the bytes haven't. */
+    assert(sector->raw.data() == bytes);
+    assert(sector->raw == raw);
+    assert(sector->data.data() == (sector->raw.data() + 4));
+    assert(sector->data == std::vector<uint8_t>(raw.begin() + 4, raw.end() - 2));
+}
+
+int main(int argc, const char* argv[])
+{
+    test_good_copy_wins();
+    test_majority();
+    test_two_copies();
+    test_unrecoverable();
+    test_shared_bytes();
+    return 0;
+}